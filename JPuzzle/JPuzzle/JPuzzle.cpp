@@ -1,5 +1,8 @@
 
 #include "JPuzzle.h"
+#include "Png.h"
+#include "MappedFile.h"
+#include "ShapeKernel.h"
 #include <string>
 #include <fstream>
 #include <stack>
@@ -8,14 +11,37 @@
 #include <list>
 #include <Eigen/LU>
 #include <iostream>
-
-JPuzzle::JPuzzle():m_pEffect(0), m_pTechnique(0), m_pVertexLayout(0), m_pVBQuad(0), m_pIBQuad(0), m_pSRVPuzzleTextureFx(0), m_pWorldfx(0), m_nPiecesAdded(0)
+#include <map>
+#include <thread>
+#include <climits>
+#include <atomic>
+#include <algorithm>
+
+#ifdef JPUZZLE_TRACK_ALLOCATIONS
+/* Counts every heap allocation of the process, AddPiece reports how many each
+   interior step made */
+static std::atomic<unsigned long long> g_Allocations(0);
+void * operator new(size_t size)
+{
+	g_Allocations++;
+	void * p = malloc(size ? size : 1);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+void * operator new[](size_t size) { return operator new(size); }
+void operator delete(void * p) { free(p); }
+void operator delete[](void * p) { free(p); }
+unsigned long long JPuzzle::AllocationCount() { return g_Allocations; }
+#else
+unsigned long long JPuzzle::AllocationCount() { return 0; }
+#endif
+
+/* Cell steps for the directions left, bottom, right and top */
+static const int g_GridStepX[4] = {-1, 0, 1, 0};
+static const int g_GridStepY[4] = {0, 1, 0, -1};
+
+JPuzzle::JPuzzle():m_pEffect(0), m_pTechnique(0), m_pVertexLayout(0), m_pVBQuad(0), m_pIBQuad(0), m_pSRVPuzzleTextureFx(0), m_pWorldfx(0), m_nPiecesAdded(0), m_ExtractTileRows(0), m_SubPixelContour(0), m_ProfileSize(0), m_SlotCandidates(8), m_SlotShapeGate(4), m_AssemblyMode(AssemblyGreedy), m_BeamWidth(8), m_BeamNext(0), m_BeamDone(0), m_RelaxIterations(100), m_MaxBorderStrips(9), m_BorderRings(8), m_BorderSearchNodes(1<<22), m_BorderAssembly(BorderFromStrips)
 {
-	int size = 1024;
-	m_LeftColors[0] = new Color[size];
-	m_LeftColors[1] = new Color[size];
-	m_RightColors[0] = new Color[size];
-	m_RightColors[1] = new Color[size];
 }
 
 HRESULT JPuzzle::CreateGraphics(ID3D10Device * pDevice)
@@ -126,110 +152,175 @@ HRESULT JPuzzle::CreateGraphics(ID3D10Device * pDevice)
 
 HRESULT JPuzzle::ExtractPuzzlePieces(char * file, ID3D10Device * pDevice)
 {
-	ID3D10Texture2D * pTexture;
-	D3DX10_IMAGE_LOAD_INFO loadInfo;
-	ZeroMemory( &loadInfo, sizeof(D3DX10_IMAGE_LOAD_INFO));
-	loadInfo.MipLevels = 1;
-	loadInfo.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
-	loadInfo.Usage = D3D10_USAGE_STAGING;
-	loadInfo.CpuAccessFlags = D3D10_CPU_ACCESS_READ;
-	loadInfo.BindFlags = 0;
 	std::string fileName(file+std::string(".png"));
-	if (FAILED(D3DX10CreateTextureFromFileA(pDevice, fileName.c_str(), &loadInfo, NULL, (ID3D10Resource**)&pTexture, NULL)))
-		DebugBreak();
+	PngDecoder png;
+	if (!png.Open(fileName.c_str()))
+		return E_FAIL;
 
-	D3D10_TEXTURE2D_DESC desc;
-	pTexture->GetDesc(&desc);
 	Texture tex;
-	tex.Init(desc.Width, desc.Height);
+	tex.Init(png.Width(), png.Height());
+	if (!png.Decode(tex.Data(), 4*tex.width))
+		return E_FAIL;
 
-	D3D10_MAPPED_TEXTURE2D mappedTex;
-	pTexture->Map(D3D10CalcSubresource(0, 0, 1), D3D10_MAP_READ, 0, &mappedTex);
-	UCHAR* pTexels = (UCHAR*)mappedTex.pData;
-	for( UINT row = 0; row < desc.Height; row++ )
-	{
-		UINT rowStart = row * mappedTex.RowPitch;
-		for( UINT col = 0; col < desc.Width; col++ )
-		{
-			UINT colStart = col * 4;
-			tex(row, col) = Vector4f(
-				pTexels[rowStart + colStart + 0], 
-				pTexels[rowStart + colStart + 1], 
-				pTexels[rowStart + colStart + 2], 
-				pTexels[rowStart + colStart + 3]);
-		}
-	}
-	pTexture->Unmap(D3D10CalcSubresource(0, 0, 1));
-	pTexture->Release();
+	std::vector<int> labels;
+	std::vector<PieceComponent> components;
+	LabelComponents(tex, labels, components);
 
 	int count=0;
-	Texture tmpTex; 
-	tmpTex.Init(tex.width, tex.height);
-	std::vector<Vector2f> piecePixels;
-	piecePixels.resize(tex.width*tex.height);
-	for (int i=0; i<tex.height; i++) {
-		for (int j=0; j<tex.width; j++) {
-			if (tex(i,j).w() > 0) {
-				char fileName[256];
-				sprintf(fileName, "%s/%s_%.3i.png", file, file, count+1);
-				if (ExtractPiece(tex, tmpTex, piecePixels, i, j, pDevice, fileName)) count++;
-			}
-		}
+	for (int i=0; i<components.size(); i++) {
+		char fileName[256];
+		sprintf(fileName, "%s/%s_%.3i.png", file, file, count+1);
+		if (ExtractPiece(tex, labels, components[i], pDevice, fileName)) count++;
 	}
-	exit(0);
 
 	return S_OK;
 }
 
-bool JPuzzle::ExtractPiece(Texture & tex, Texture & tmpTex, std::vector<Vector2f> & piecePixels, int i, int j, ID3D10Device * pDevice, char * fileName)
+void JPuzzle::LabelComponents(Texture & tex, std::vector<int> & labels, std::vector<PieceComponent> & components)
 {
-	tmpTex.ClearChannels();
+	/* Two-pass union-find labeling of the 8-connected non-transparent regions.
+	   Every root is the smallest pixel index of its set, so the components come
+	   out in the same scan order the pieces were numbered in before. */
+	int width = tex.width, height = tex.height;
+	labels.assign(width*height, -1);
+	int * parent = labels.data();
+
+	auto Find = [parent] (int x) {
+		while (parent[x] != x) {
+			parent[x] = parent[parent[x]];
+			x = parent[x];
+		}
+		return x;
+	};
+	auto Union = [&Find, parent] (int a, int b) {
+		a = Find(a);
+		b = Find(b);
+		if (a < b) parent[b] = a;
+		else if (b < a) parent[a] = b;
+	};
 
-	int nPiecePixels = 0;
-	std::queue<std::pair<int,int> > q;
-	q.push(std::pair<int,int>(i,j));
-	while (!q.empty()) {
-		std::pair<int,int> pair = q.front();
-		q.pop();
-		int ii=pair.first, jj=pair.second;
-		if (tex(ii, jj).w() == 0) continue;
+	int nBands = std::thread::hardware_concurrency();
+	if (nBands < 1) nBands = 1;
+	if (nBands > height/64) nBands = max(1, height/64);
+	std::vector<int> bandStart(nBands+1);
+	for (int b=0; b<=nBands; b++) bandStart[b] = (int)((long long)height*b/nBands);
+
+	// First pass, each band links its own pixels only
+	auto LabelBand = [&] (int band) {
+		for (int i=bandStart[band]; i<bandStart[band+1]; i++) {
+			for (int j=0; j<width; j++) {
+				int p = width*i + j;
+				if (tex.texels[p].w() == 0) continue;
+				parent[p] = p;
+				if (j > 0 && parent[p-1] >= 0) Union(p, p-1);
+				if (i > bandStart[band]) {
+					if (j > 0 && parent[p-width-1] >= 0) Union(p, p-width-1);
+					if (parent[p-width] >= 0) Union(p, p-width);
+					if (j+1 < width && parent[p-width+1] >= 0) Union(p, p-width+1);
+				}
+			}
+		}
+	};
+	std::vector<std::thread> threads;
+	for (int b=1; b<nBands; b++) threads.push_back(std::thread(LabelBand, b));
+	LabelBand(0);
+	for (int t=0; t<threads.size(); t++) threads[t].join();
+
+	// Stitch the bands together across their seams
+	for (int b=1; b<nBands; b++) {
+		int i = bandStart[b];
+		for (int j=0; j<width; j++) {
+			int p = width*i + j;
+			if (parent[p] < 0) continue;
+			if (j > 0 && parent[p-width-1] >= 0) Union(p, p-width-1);
+			if (parent[p-width] >= 0) Union(p, p-width);
+			if (j+1 < width && parent[p-width+1] >= 0) Union(p, p-width+1);
+		}
+	}
 
-		if (tex(ii, jj).w() > 200) {
-			tmpTex(ii,jj) = tex(ii,jj);
-			piecePixels[nPiecePixels++] = Vector2f(jj,ii);
+	// Second pass, parents always point to smaller indices so one sweep flattens every tree
+	for (int p=0; p<width*height; p++) {
+		if (parent[p] >= 0) parent[p] = parent[parent[p]];
+	}
+
+	// Bounding boxes and sizes over the opaque pixels of each component
+	components.resize(0);
+	std::map<int, int> rootToComponent;
+	int lastRoot = -1, lastComponent = -1;
+	for (int i=0; i<height; i++) {
+		for (int j=0; j<width; j++) {
+			int p = width*i + j;
+			int root = labels[p];
+			if (root < 0) continue;
+			if (root != lastRoot) {
+				if (root == p) {
+					PieceComponent c;
+					c.root = root;
+					c.nPixels = 0;
+					c.xMin = c.yMin = INT_MAX;
+					c.xMax = c.yMax = -1;
+					rootToComponent[root] = components.size();
+					components.push_back(c);
+				}
+				lastRoot = root;
+				lastComponent = rootToComponent[root];
+			}
+			if (tex.texels[p].w() <= 200) continue;
+			PieceComponent & c = components[lastComponent];
+			c.nPixels++;
+			if (j < c.xMin) c.xMin = j;
+			if (j > c.xMax) c.xMax = j;
+			if (i < c.yMin) c.yMin = i;
+			if (i > c.yMax) c.yMax = i;
 		}
-		tex(ii,jj).w() = 0;
+	}
+}
 
-		if (tex(ii+1, jj).w() > 0) {q.push(std::pair<int,int>(ii+1,jj)); }
-		if (tex(ii-1, jj).w() > 0) {q.push(std::pair<int,int>(ii-1,jj)); }
-		if (tex(ii, jj+1).w() > 0) {q.push(std::pair<int,int>(ii,jj+1)); }
-		if (tex(ii, jj-1).w() > 0) {q.push(std::pair<int,int>(ii,jj-1)); }
-		if (tex(ii+1, jj+1).w() > 0) {q.push(std::pair<int,int>(ii+1,jj+1)); }
-		if (tex(ii-1, jj+1).w() > 0) {q.push(std::pair<int,int>(ii-1,jj+1)); }
-		if (tex(ii+1, jj-1).w() > 0) {q.push(std::pair<int,int>(ii+1,jj-1)); }
-		if (tex(ii-1, jj-1).w() > 0) {q.push(std::pair<int,int>(ii-1,jj-1)); }
+bool JPuzzle::ExtractPiece(Texture & tex, std::vector<int> & labels, PieceComponent & component, ID3D10Device * pDevice, char * fileName)
+{
+	if (component.nPixels < 200) return 0;
+
+	/* Only the bounding box of the component is copied and cleared */
+	Texture piece;
+	piece.Init(component.xMax-component.xMin+1, component.yMax-component.yMin+1);
+	for (int i=component.yMin; i<=component.yMax; i++) {
+		const int * rowLabels = &labels[tex.width*i];
+		for (int j=component.xMin; j<=component.xMax; j++) {
+			if (rowLabels[j] == component.root && tex(i,j).w() > 200)
+				piece(i-component.yMin, j-component.xMin) = tex(i,j);
+		}
 	}
-	if (nPiecePixels < 200) return 0;
-	
-	float xMin=FLT_MAX, xMax=-FLT_MIN, yMin=FLT_MAX, yMax=-FLT_MAX; 
-	for (int i=0; i<nPiecePixels; i++) {
-		if (piecePixels[i].x() < xMin) xMin = piecePixels[i].x();
-		if (piecePixels[i].x() > xMax) xMax = piecePixels[i].x();
-		if (piecePixels[i].y() < yMin) yMin = piecePixels[i].y();
-		if (piecePixels[i].y() > yMin) yMax = piecePixels[i].y();
+	SavePiece(piece, pDevice, fileName);
+
+	return 1;
+}
+
+void JPuzzle::SavePiece(Texture & piece, ID3D10Device * pDevice, char * fileName)
+{
+	/* Center the bounding box buffer in a g_TextureSize window, clipping what does not fit */
+	int offsetX = (g_TextureSize-(piece.width-1))/2;
+	int offsetY = (g_TextureSize-(piece.height-1))/2;
+	int colStart = max(0, -offsetX), colEnd = min(piece.width, g_TextureSize-offsetX);
+	Texture window;
+	window.Init(g_TextureSize, g_TextureSize);
+	if (colStart < colEnd) {
+		for (int i=max(0, -offsetY); i<min(piece.height, g_TextureSize-offsetY); i++)
+			memcpy(&window(offsetY+i, offsetX+colStart), &piece(i, colStart), (colEnd-colStart)*sizeof(Vector4uc));
 	}
 
-	int bbWidth = xMax-xMin;
-	int bbHeight = yMax-yMin;
-	int offsetX = xMin-(g_TextureSize-bbWidth)/2;
-	int offsetY = yMin-(g_TextureSize-bbHeight)/2;
+	/* Without a device the piece is encoded on the CPU */
+	if (!pDevice) {
+		if (!WritePng(fileName, window.Data(), window.width, window.height, 4*window.width))
+			DebugBreak();
+		return;
+	}
 
 	ID3D10Texture2D * pTexture;
 	D3D10_TEXTURE2D_DESC texDesc;
 	ZeroMemory(&texDesc, sizeof(D3D10_TEXTURE2D_DESC));
 	texDesc.MipLevels = 1;
-	texDesc.Width = g_TextureSize;
-	texDesc.Height = g_TextureSize;
+	texDesc.Width = window.width;
+	texDesc.Height = window.height;
 	texDesc.ArraySize = 1;
 	texDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
 	texDesc.Usage = D3D10_USAGE_DYNAMIC;
@@ -243,19 +334,8 @@ bool JPuzzle::ExtractPiece(Texture & tex, Texture & tmpTex, std::vector<Vector2f
 	D3D10_MAPPED_TEXTURE2D mappedTex;
 	pTexture->Map(D3D10CalcSubresource(0, 0, 1), D3D10_MAP_WRITE_DISCARD, 0, &mappedTex);
 	UCHAR* pTexels = (UCHAR*)mappedTex.pData;
-	float scale = 2;
-	for(UINT row = 0; row < g_TextureSize; row++ ) {
-		UINT rowStart = row * mappedTex.RowPitch;
-		for( UINT col = 0; col < g_TextureSize; col++ ) {
-			UINT colStart = col * 4;
-
-			Vector4f color(0,0,0,0);
-			if (tmpTex.Inside(offsetY+row, offsetX+col)) color = tmpTex(offsetY+row, offsetX+col);
-			pTexels[rowStart + colStart + 0] = color[0];
-			pTexels[rowStart + colStart + 1] = color[1];
-			pTexels[rowStart + colStart + 2] = color[2];
-			pTexels[rowStart + colStart + 3] = color[3];
-		}
+	for (UINT row = 0; row < (UINT)window.height; row++) {
+		memcpy(pTexels + row*mappedTex.RowPitch, window.Data() + 4*window.width*row, 4*window.width);
 	}
 	pTexture->Unmap(D3D10CalcSubresource(0, 0, 1));
 
@@ -263,14 +343,212 @@ bool JPuzzle::ExtractPiece(Texture & tex, Texture & tmpTex, std::vector<Vector2f
 		DebugBreak();
 
 	pTexture->Release();
+}
+
+HRESULT JPuzzle::ExtractPuzzlePiecesTiled(char * file, int tileRows, ID3D10Device * pDevice)
+{
+	/* Rows come from a mapped <file>.rgba if there is one, otherwise the PNG
+	   is mapped and inflated one row at a time. Only a tile of rows, its
+	   labels and the still open pieces are ever held in memory. */
+	MappedFile mapped;
+	PngDecoder png;
+	const RawImageHeader * raw = 0;
+	int width, height;
+	if (mapped.Open((file+std::string(".rgba")).c_str()) && mapped.Size() >= sizeof(RawImageHeader)) {
+		raw = (const RawImageHeader*)mapped.Data();
+		if (memcmp(raw->magic, "RGBA", 4) != 0 || raw->width <= 0 || raw->height <= 0 || raw->pitch/4 < raw->width ||
+			mapped.Size() < sizeof(RawImageHeader) + (size_t)raw->pitch*raw->height)
+			return E_FAIL;
+		width = raw->width;
+		height = raw->height;
+	} else {
+		if (!mapped.Open((file+std::string(".png")).c_str()) || !png.Open(mapped.Data(), mapped.Size()))
+			return E_FAIL;
+		width = png.Width();
+		height = png.Height();
+	}
+	if (tileRows > height) tileRows = height;
+
+	Texture tile;
+	tile.Init(width, tileRows);
+	std::vector<int> labels;
+	std::vector<PieceComponent> components;
+	std::vector<int> rootToGlobal(width*tileRows, -1);
+	std::vector<int> prevRow(width, -1);
+
+	/* Ids of the pieces still open and of the current tile's components, merged
+	   across the tile seams. Open pieces are renumbered after every tile. */
+	std::vector<int> parent;
+	std::map<int, OpenPiece> openPieces;
+	auto Find = [&parent] (int x) {
+		while (parent[x] != x) {
+			parent[x] = parent[parent[x]];
+			x = parent[x];
+		}
+		return x;
+	};
+	auto Union = [&] (int a, int b) {
+		a = Find(a);
+		b = Find(b);
+		if (a == b) return;
+		if (b < a) std::swap(a, b);
+		parent[b] = a;
+		OpenPiece & dst = openPieces[a];
+		OpenPiece & src = openPieces[b];
+		if (src.nPixels > 0) {
+			dst.xMin = min(dst.xMin, src.xMin);
+			dst.xMax = max(dst.xMax, src.xMax);
+			dst.yMin = min(dst.yMin, src.yMin);
+			dst.yMax = max(dst.yMax, src.yMax);
+		}
+		dst.nPixels += src.nPixels;
+		int base = dst.texels.size();
+		for (int r=0; r<src.runs.size(); r++) {
+			PixelRun run = src.runs[r];
+			run.offset += base;
+			dst.runs.push_back(run);
+		}
+		dst.texels.insert(dst.texels.end(), src.texels.begin(), src.texels.end());
+		openPieces.erase(b);
+	};
+
+	int count = 0;
+	auto Emit = [&] (OpenPiece & piece) {
+		char fileName[256];
+		sprintf(fileName, "%s/%s_%.3i.png", file, file, count+1);
+		if (EmitOpenPiece(piece, pDevice, fileName)) count++;
+	};
+
+	auto ProcessTile = [&] (int tileY, int nRows) {
+		// Rows past the end of the sheet stay transparent
+		if (nRows < tileRows) memset(tile.Data() + 4*width*nRows, 0, 4*width*(tileRows-nRows));
+		LabelComponents(tile, labels, components);
+
+		for (int c=0; c<components.size(); c++) {
+			PieceComponent & comp = components[c];
+			int id = parent.size();
+			parent.push_back(id);
+			rootToGlobal[comp.root] = id;
+			OpenPiece & piece = openPieces[id];
+			piece.nPixels = comp.nPixels;
+			piece.xMin = comp.xMin, piece.xMax = comp.xMax;
+			piece.yMin = comp.yMin, piece.yMax = comp.yMax;
+			if (comp.nPixels > 0) piece.yMin += tileY, piece.yMax += tileY;
+		}
+
+		// Opaque pixels are kept as horizontal runs in their piece
+		for (int i=0; i<nRows; i++) {
+			OpenPiece * piece = 0;
+			int lastId = -1, lastJ = -2;
+			for (int j=0; j<width; j++) {
+				int label = labels[width*i + j];
+				if (label < 0 || tile(i,j).w() <= 200) continue;
+				int id = rootToGlobal[label];
+				if (id != lastId || j != lastJ+1) {
+					piece = &openPieces[id];
+					PixelRun run = {tileY+i, j, 0, (int)piece->texels.size()};
+					piece->runs.push_back(run);
+					lastId = id;
+				}
+				piece->runs.back().n++;
+				piece->texels.push_back(tile(i,j));
+				lastJ = j;
+			}
+		}
+
+		// Stitch to the last row of the previous tile
+		for (int j=0; j<width; j++) {
+			int label = labels[j];
+			if (label < 0) continue;
+			for (int d=-1; d<=1; d++) {
+				if (j+d >= 0 && j+d < width && prevRow[j+d] >= 0) Union(rootToGlobal[label], prevRow[j+d]);
+			}
+		}
+		for (int j=0; j<width; j++) {
+			int label = labels[width*(tileRows-1) + j];
+			prevRow[j] = label < 0 ? -1 : rootToGlobal[label];
+		}
+
+		// Everything not reaching the bottom row of this tile is complete
+		std::vector<bool> reachesBottom(parent.size(), false);
+		for (int j=0; j<width; j++) {
+			if (prevRow[j] >= 0) reachesBottom[Find(prevRow[j])] = true;
+		}
+		for (std::map<int, OpenPiece>::iterator it = openPieces.begin(); it != openPieces.end();) {
+			if (reachesBottom[it->first]) {
+				++it;
+				continue;
+			}
+			Emit(it->second);
+			it = openPieces.erase(it);
+		}
+
+		// Carry the open pieces over as ids 0..n-1, in the same order
+		std::vector<int> carriedId(parent.size(), -1);
+		std::map<int, OpenPiece> carried;
+		int nCarried = 0;
+		for (std::map<int, OpenPiece>::iterator it = openPieces.begin(); it != openPieces.end(); ++it) {
+			carriedId[it->first] = nCarried;
+			OpenPiece & piece = carried[nCarried++];
+			piece.runs.swap(it->second.runs);
+			piece.texels.swap(it->second.texels);
+			piece.nPixels = it->second.nPixels;
+			piece.xMin = it->second.xMin, piece.xMax = it->second.xMax;
+			piece.yMin = it->second.yMin, piece.yMax = it->second.yMax;
+		}
+		for (int j=0; j<width; j++) {
+			if (prevRow[j] >= 0) prevRow[j] = carriedId[Find(prevRow[j])];
+		}
+		openPieces.swap(carried);
+		parent.resize(nCarried);
+		for (int i=0; i<nCarried; i++) parent[i] = i;
+	};
+
+	int tileY = 0, nRows = 0;
+	auto OnRow = [&] (int row, const unsigned char * rgba) {
+		memcpy(tile.Data() + 4*width*nRows, rgba, 4*width);
+		if (++nRows == tileRows) {
+			ProcessTile(tileY, nRows);
+			tileY += nRows;
+			nRows = 0;
+		}
+	};
+	if (raw) {
+		const unsigned char * rows = mapped.Data() + sizeof(RawImageHeader);
+		for (int row=0; row<height; row++) OnRow(row, rows + (size_t)raw->pitch*row);
+	} else if (!png.DecodeRows(OnRow)) {
+		return E_FAIL;
+	}
+	if (nRows > 0) ProcessTile(tileY, nRows);
+
+	for (std::map<int, OpenPiece>::iterator it = openPieces.begin(); it != openPieces.end(); ++it)
+		Emit(it->second);
+
+	return S_OK;
+}
+
+bool JPuzzle::EmitOpenPiece(OpenPiece & piece, ID3D10Device * pDevice, char * fileName)
+{
+	if (piece.nPixels < 200) return 0;
+
+	Texture bbox;
+	bbox.Init(piece.xMax-piece.xMin+1, piece.yMax-piece.yMin+1);
+	for (int r=0; r<piece.runs.size(); r++) {
+		PixelRun & run = piece.runs[r];
+		memcpy(&bbox(run.y-piece.yMin, run.x-piece.xMin), &piece.texels[run.offset], run.n*sizeof(Vector4uc));
+	}
+	SavePiece(bbox, pDevice, fileName);
 
 	return 1;
 }
 
 HRESULT JPuzzle::Init(char * file, int nToLoad, ID3D10Device * pDevice)
 {
-	HRESULT hr = CreateGraphics(pDevice);
-	if (hr != S_OK) return hr;
+	/* pDevice may be NULL to load and process the pieces headless */
+	if (pDevice) {
+		HRESULT hr = CreateGraphics(pDevice);
+		if (hr != S_OK) return hr;
+	}
 
 	/* Load puzzle pieces and textures */
 	std::string sFile(file);
@@ -287,68 +565,73 @@ HRESULT JPuzzle::Init(char * file, int nToLoad, ID3D10Device * pDevice)
 	};
 	GetPuzzleFiles();
 	if (fileNames.size() < 1) {
-		ExtractPuzzlePieces(file, pDevice);
+		HRESULT hr = m_ExtractTileRows > 0 ? ExtractPuzzlePiecesTiled(file, m_ExtractTileRows, pDevice) : ExtractPuzzlePieces(file, pDevice);
+		if (FAILED(hr)) return hr;
 		GetPuzzleFiles();
 	}
 	
-	m_nPuzzlePieces = 0;
+	/* Features of pieces seen before are read back from the cache */
+	std::string cacheFile(sFile+"features.cache");
+	MappedFile cache;
+	std::map<unsigned long long, std::pair<const unsigned char *, size_t> > cached;
+	if (cache.Open(cacheFile.c_str())) ReadFeatureCache(cache.Data(), cache.Size(), cached);
+
+	m_nPuzzlePieces = fileNames.size();
+	if (m_nPuzzlePieces > nToLoad) m_nPuzzlePieces = max(nToLoad, 1);
 	m_PuzzlePieces = new PuzzlePiece[fileNames.size()];
-	for (int i=0; i<fileNames.size(); i++) {
-		ID3D10ShaderResourceView * pRSV = NULL;
-		D3DX10_IMAGE_LOAD_INFO loadInfo;
-		ZeroMemory( &loadInfo, sizeof(D3DX10_IMAGE_LOAD_INFO));
-		loadInfo.MipLevels = 1;
-		loadInfo.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
-		loadInfo.Usage = D3D10_USAGE_DYNAMIC;
-		loadInfo.CpuAccessFlags = D3D10_CPU_ACCESS_WRITE;
-		loadInfo.BindFlags = D3D10_BIND_SHADER_RESOURCE;
-		if (FAILED(D3DX10CreateShaderResourceViewFromFileA(pDevice, (sFile+fileNames[i]).c_str(), &loadInfo, NULL, &pRSV, NULL))) 
-			DebugBreak();
+	std::vector<unsigned long long> hashes(m_nPuzzlePieces);
+	std::vector<char> missed(m_nPuzzlePieces, 0);
+
+	/* Pieces are independent here, each worker takes the next unclaimed one and
+	   only writes to its own piece, so the result does not depend on scheduling */
+	auto LoadPiece = [&] (int i) {
+		PuzzlePiece& piece = m_PuzzlePieces[i];
+		piece.index = i;
+		piece.transform = Matrix4f::Identity();
 
-		/* Create the puzzle piece */
-		PuzzlePiece& piece = m_PuzzlePieces[m_nPuzzlePieces];
-		piece.SRVPuzzleTexture = pRSV;
-		ID3D10Texture2D * pTexture;
-		loadInfo.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
-		loadInfo.Usage = D3D10_USAGE_STAGING;
-		loadInfo.CpuAccessFlags = D3D10_CPU_ACCESS_READ;
-		loadInfo.BindFlags = 0;
-		if (FAILED(D3DX10CreateTextureFromFileA(pDevice, (sFile+fileNames[i]).c_str(), &loadInfo, NULL, (ID3D10Resource**)&pTexture, NULL)))
+		/* Decode the piece straight into its texel buffer */
+		MappedFile pieceFile;
+		PngDecoder png;
+		if (!pieceFile.Open((sFile+fileNames[i]).c_str()) || !png.Open(pieceFile.Data(), pieceFile.Size()))
 			DebugBreak();
+		piece.tex.Init(png.Width(), png.Height());
+		if (!png.Decode(piece.tex.Data(), 4*piece.tex.width))
+			DebugBreak();
+		hashes[i] = HashBytes(pieceFile.Data(), pieceFile.Size());
 
-		D3D10_TEXTURE2D_DESC desc;
-		pTexture->GetDesc(&desc);
-		D3D10_MAPPED_TEXTURE2D mappedTex;
-		pTexture->Map(D3D10CalcSubresource(0, 0, 1), D3D10_MAP_READ, 0, &mappedTex);
-		piece.tex.Init(desc.Width, desc.Height);
-		UCHAR* pTexels = (UCHAR*)mappedTex.pData;
-		for( UINT row = 0; row < desc.Height; row++ )
-		{
-			UINT rowStart = row * mappedTex.RowPitch;
-			for( UINT col = 0; col < desc.Width; col++ )
-			{
-				UINT colStart = col * 4;
-				piece.tex(row, col) = Vector4f(
-					pTexels[rowStart + colStart + 0], 
-					pTexels[rowStart + colStart + 1], 
-					pTexels[rowStart + colStart + 2], 
-					pTexels[rowStart + colStart + 3]);
-			}
-		}
-		pTexture->Unmap(D3D10CalcSubresource(0, 0, 1));
-		pTexture->Release();
-
-		piece.transform = Matrix4f::Identity();
-		//m_PuzzlePieces[m_nPuzzlePieces++] = piece;
-		m_nPuzzlePieces++;
-
+		std::map<unsigned long long, std::pair<const unsigned char *, size_t> >::const_iterator hit = cached.find(hashes[i]);
+		if (hit != cached.end() && ReadPieceFeatures(piece, hit->second.first, hit->second.second))
+			return;
 		Texture tmpTex(piece.tex);
 		for (int k=0; k<m_MaxColorLayers; k++)
-			ProcessPuzzlePiece(tmpTex, k, pDevice);
-
-		if (i>=nToLoad-1) break;
+			ProcessPuzzlePiece(piece, tmpTex, k);
+		ComputeGradientSums(piece);
+		missed[i] = 1;
+	};
+	std::atomic<int> nextPiece(0);
+	auto Worker = [&] () {
+		for (int i; (i = nextPiece++) < m_nPuzzlePieces; )
+			LoadPiece(i);
+	};
+	int nThreads = min((int)std::thread::hardware_concurrency(), m_nPuzzlePieces);
+	std::vector<std::thread> threads;
+	for (int t=1; t<nThreads; t++) threads.push_back(std::thread(Worker));
+	Worker();
+	for (int t=0; t<threads.size(); t++) threads[t].join();
+
+	/* The GPU copy is only needed for rendering */
+	for (int i=0; pDevice && i<m_nPuzzlePieces; i++) {
+		if (FAILED(CreatePieceTexture(m_PuzzlePieces[i], pDevice)))
+			DebugBreak();
 	}
+
+	cached.clear();
+	cache.Close();
+	if (std::find(missed.begin(), missed.end(), 1) != missed.end()) WriteFeatureCache(cacheFile.c_str(), hashes);
+	BuildEdgeIndex();
+	BuildEdgeProfiles();
 	m_nPiecesAdded = 1;
+	m_AddedPuzzlePieces.reserve(m_nPuzzlePieces);
 	m_AddedPuzzlePieces.push_back(&m_PuzzlePieces[0]);
 	m_PuzzlePieces[0].isAdded=1;
 	for (int i=1; i<m_nPuzzlePieces; i++) {
@@ -358,38 +641,177 @@ HRESULT JPuzzle::Init(char * file, int nToLoad, ID3D10Device * pDevice)
 	return S_OK;
 }
 
-bool JPuzzle::OnOutsideBoundary(int i, int j, Texture & tex)
+unsigned long long JPuzzle::HashBytes(const unsigned char * data, size_t size)
 {
-	if (tex(i, j).w() > 0)
-		return 0;
+	/* 64 bit FNV-1a */
+	unsigned long long hash = 14695981039346656037ull;
+	for (size_t i=0; i<size; i++) {
+		hash ^= data[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
 
-	int k=-1+i;
-	for (; k<=i+1; k++) {
-		int l=-1+j;
-		for (; l<=j+1; l++) {
-			if (tex(k, l).w() > 0) 
-				return 1;
-		}
+template<class T>
+static void PutArray(std::vector<unsigned char> & out, const T * data, unsigned int n)
+{
+	const unsigned char * bytes = (const unsigned char *)data;
+	out.insert(out.end(), bytes, bytes + n*sizeof(T));
+}
+
+template<class T>
+static void PutVector(std::vector<unsigned char> & out, const std::vector<T> & v)
+{
+	unsigned int n = v.size();
+	PutArray(out, &n, 1);
+	PutArray(out, v.data(), n);
+}
+
+struct ByteReader {
+	const unsigned char * pos;
+	const unsigned char * end;
+	template<class T>
+	bool GetArray(T * data, unsigned int n) {
+		if ((size_t)(end-pos) < n*sizeof(T)) return 0;
+		memcpy(data, pos, n*sizeof(T));
+		pos += n*sizeof(T);
+		return 1;
+	}
+	template<class T>
+	bool GetVector(std::vector<T> & v) {
+		unsigned int n;
+		if (!GetArray(&n, 1) || (size_t)(end-pos)/sizeof(T) < n) return 0;
+		v.resize(n);
+		return GetArray(v.data(), n);
+	}
+};
+
+void JPuzzle::WritePieceFeatures(PuzzlePiece & piece, std::vector<unsigned char> & out)
+{
+	PutArray(out, piece.endPoints, 4);
+	PutArray(out, piece.edgeNor, 4);
+	PutArray(out, piece.totalCurvature, 4);
+	PutArray(out, piece.totalLength, 4);
+	PutArray(out, piece.edgeIsBorder, 4);
+	PutArray(out, piece.edgeCovered, 4);
+	PutArray(out, &piece.isBorderPiece, 1);
+	for (int i=0; i<4; i++) {
+		PutVector(out, piece.edges[i]);
+		PutVector(out, piece.projectedPoints[i]);
+		for (int k=0; k<m_MaxColorLayers; k++)
+			PutVector(out, piece.edgeColors[i][k]);
+		PutVector(out, piece.gradientSums[i]);
 	}
-	return 0;
-	//return tex(i-1,j).w() > 0 || tex(i+1,j).w() > 0 || tex(i,j-1).w() > 0 || tex(i,j+1).w() > 0;
 }
 
-bool JPuzzle::OnBoundary(int i, int j, Texture & tex)
+bool JPuzzle::ReadPieceFeatures(PuzzlePiece & piece, const unsigned char * data, size_t size)
 {
-	if (tex(i, j).w() == 0)
+	/* Decoded aside and only moved into the piece once all of it read back, so
+	   a broken entry leaves the piece as it was for ProcessPuzzlePiece */
+	PuzzlePiece decoded;
+	ByteReader in = {data, data+size};
+	bool ok = in.GetArray(decoded.endPoints, 4) && in.GetArray(decoded.edgeNor, 4) &&
+		in.GetArray(decoded.totalCurvature, 4) && in.GetArray(decoded.totalLength, 4) &&
+		in.GetArray(decoded.edgeIsBorder, 4) && in.GetArray(decoded.edgeCovered, 4) &&
+		in.GetArray(&decoded.isBorderPiece, 1);
+	for (int i=0; ok && i<4; i++) {
+		ok = in.GetVector(decoded.edges[i]) && in.GetVector(decoded.projectedPoints[i]);
+		for (int k=0; ok && k<m_MaxColorLayers; k++)
+			ok = in.GetVector(decoded.edgeColors[i][k]);
+		ok = ok && in.GetVector(decoded.gradientSums[i]);
+	}
+	if (!ok || in.pos != in.end)
 		return 0;
 
-	int k=-1+i;
-	for (; k<=i+1; k++) {
-		int l=-1+j;
-		for (; l<=j+1; l++) {
-			if (tex(k, l).w() == 0) 
-				return 1;
-		}
+	memcpy(piece.endPoints, decoded.endPoints, sizeof(piece.endPoints));
+	memcpy(piece.edgeNor, decoded.edgeNor, sizeof(piece.edgeNor));
+	memcpy(piece.totalCurvature, decoded.totalCurvature, sizeof(piece.totalCurvature));
+	memcpy(piece.totalLength, decoded.totalLength, sizeof(piece.totalLength));
+	memcpy(piece.edgeIsBorder, decoded.edgeIsBorder, sizeof(piece.edgeIsBorder));
+	memcpy(piece.edgeCovered, decoded.edgeCovered, sizeof(piece.edgeCovered));
+	piece.isBorderPiece = decoded.isBorderPiece;
+	for (int i=0; i<4; i++) {
+		piece.edges[i].swap(decoded.edges[i]);
+		piece.projectedPoints[i].swap(decoded.projectedPoints[i]);
+		for (int k=0; k<m_MaxColorLayers; k++)
+			piece.edgeColors[i][k].swap(decoded.edgeColors[i][k]);
+		piece.gradientSums[i].swap(decoded.gradientSums[i]);
 	}
-	return 0;
-	//return tex(i-1,j).w() > 0 || tex(i+1,j).w() > 0 || tex(i,j-1).w() > 0 || tex(i,j+1).w() > 0;
+	return 1;
+}
+
+void JPuzzle::ReadFeatureCache(const unsigned char * data, size_t size, std::map<unsigned long long, std::pair<const unsigned char *, size_t> > & entries)
+{
+	/* "JPFC", version, settings, entry count, then (hash, size, features) per piece.
+	   A cache written by another version is ignored and rebuilt. */
+	ByteReader in = {data, data+size};
+	char magic[4];
+	unsigned int version, nEntries;
+	if (!in.GetArray(magic, 4) || memcmp(magic, "JPFC", 4) != 0) return;
+	if (!in.GetArray(&version, 1) || version != m_FeatureCacheVersion) return;
+	unsigned int settings;
+	if (!in.GetArray(&settings, 1) || settings != FeatureCacheSettings()) return;
+	if (!in.GetArray(&nEntries, 1)) return;
+	for (unsigned int i=0; i<nEntries; i++) {
+		unsigned long long hash;
+		unsigned int entrySize;
+		if (!in.GetArray(&hash, 1) || !in.GetArray(&entrySize, 1) || (size_t)(in.end-in.pos) < entrySize) break;
+		entries[hash] = std::make_pair(in.pos, (size_t)entrySize);
+		in.pos += entrySize;
+	}
+}
+
+void JPuzzle::WriteFeatureCache(const char * fileName, std::vector<unsigned long long> & hashes)
+{
+	std::vector<unsigned char> out;
+	unsigned int version = m_FeatureCacheVersion;
+	unsigned int nEntries = hashes.size();
+	PutArray(out, "JPFC", 4);
+	unsigned int settings = FeatureCacheSettings();
+	PutArray(out, &version, 1);
+	PutArray(out, &settings, 1);
+	PutArray(out, &nEntries, 1);
+	std::vector<unsigned char> entry;
+	for (int i=0; i<hashes.size(); i++) {
+		entry.resize(0);
+		WritePieceFeatures(m_PuzzlePieces[i], entry);
+		unsigned int entrySize = entry.size();
+		PutArray(out, &hashes[i], 1);
+		PutArray(out, &entrySize, 1);
+		out.insert(out.end(), entry.begin(), entry.end());
+	}
+
+	FILE * file = fopen(fileName, "wb");
+	if (!file) return;
+	fwrite(out.data(), 1, out.size(), file);
+	fclose(file);
+}
+
+HRESULT JPuzzle::CreatePieceTexture(PuzzlePiece & piece, ID3D10Device * pDevice)
+{
+	Texture & tex = piece.tex;
+	D3D10_TEXTURE2D_DESC texDesc;
+	ZeroMemory(&texDesc, sizeof(D3D10_TEXTURE2D_DESC));
+	texDesc.MipLevels = 1;
+	texDesc.Width = tex.width;
+	texDesc.Height = tex.height;
+	texDesc.ArraySize = 1;
+	texDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+	texDesc.Usage = D3D10_USAGE_DEFAULT;
+	texDesc.BindFlags = D3D10_BIND_SHADER_RESOURCE;
+	DXGI_SAMPLE_DESC sampleDesc = {1, 0};
+	texDesc.SampleDesc = sampleDesc;
+	D3D10_SUBRESOURCE_DATA initData;
+	initData.pSysMem = tex.Data();
+	initData.SysMemPitch = 4*tex.width;
+	initData.SysMemSlicePitch = 0;
+
+	ID3D10Texture2D * pTexture;
+	HRESULT hr = pDevice->CreateTexture2D(&texDesc, &initData, &pTexture);
+	if (FAILED(hr)) return hr;
+	hr = pDevice->CreateShaderResourceView(pTexture, NULL, &piece.SRVPuzzleTexture);
+	pTexture->Release();
+	return hr;
 }
 
 int CompareCurvature(const void * a, const void * b) 
@@ -399,110 +821,177 @@ int CompareCurvature(const void * a, const void * b)
 	if ( *(float*)a >  *(float*)b ) return (int)1;
 }
 
-void JPuzzle::ProcessPuzzlePiece(Texture & tex, int edgeInsetLevel, ID3D10Device * pDevice)
+void JPuzzle::ComputeCurvatures(const std::vector<Vector2f> & pts, std::vector<float> & curvatures, std::vector<float> & angles)
+{
+	/* For every contour point the principal directions of the curvatureSize+1
+	   points behind and ahead of it give two normals, their angle and their mean.
+	   A parabola fitted in that frame over both windows gives the curvature. */
+	const int curvatureSize = 7;
+	const int windowSize = curvatureSize+1;
+	int nPoints = pts.size();
+	curvatures.resize(nPoints);
+	angles.resize(nPoints);
+
+	// Window sums are slid along the closed contour, w ending at point s covers s-curvatureSize..s.
+	// Coordinates are taken relative to the first point to keep the sums well conditioned.
+	std::vector<double> sx(nPoints), sy(nPoints), sxx(nPoints), sxy(nPoints), syy(nPoints);
+	double ox = pts[0].x(), oy = pts[0].y();
+	double ax = 0, ay = 0, axx = 0, axy = 0, ayy = 0;
+	for (int j=-curvatureSize; j<nPoints; j++) {
+		const Vector2f & in = pts[(j+nPoints)%nPoints];
+		double x = in.x()-ox, y = in.y()-oy;
+		ax += x; ay += y; axx += x*x; axy += x*y; ayy += y*y;
+		if (j > 0) {
+			const Vector2f & out = pts[(j-windowSize+nPoints)%nPoints];
+			double x = out.x()-ox, y = out.y()-oy;
+			ax -= x; ay -= y; axx -= x*x; axy -= x*y; ayy -= y*y;
+		}
+		if (j >= 0) {
+			sx[j] = ax; sy[j] = ay; sxx[j] = axx; sxy[j] = axy; syy[j] = ayy;
+		}
+	}
+
+	// Normal of each window, the eigenvector of the smaller eigenvalue of its scatter matrix
+	std::vector<float> nx(nPoints), ny(nPoints), mx(nPoints), my(nPoints);
+	for (int s=0; s<nPoints; s++) {
+		double meanX = sx[s]/windowSize, meanY = sy[s]/windowSize;
+		double a = sxx[s]/windowSize - meanX*meanX;
+		double b = sxy[s]/windowSize - meanX*meanY;
+		double c = syy[s]/windowSize - meanY*meanY;
+		double lambda = .5*(a+c) - sqrt(.25*(a-c)*(a-c) + b*b);
+		double v1x = b, v1y = lambda-a;
+		double v2x = lambda-c, v2y = b;
+		double n1 = v1x*v1x + v1y*v1y, n2 = v2x*v2x + v2y*v2y;
+		double vx = n1 > n2 ? v1x : v2x, vy = n1 > n2 ? v1y : v2y;
+		double len = sqrt(max(n1, n2));
+		if (len < 1e-12) vx = a < c ? 1 : 0, vy = a < c ? 0 : 1, len = 1;
+		nx[s] = (float)(vx/len);
+		ny[s] = (float)(vy/len);
+		mx[s] = (float)(meanX+ox);
+		my[s] = (float)(meanY+oy);
+	}
+
+	// Orient a window normal against the point it is attached to
+	auto Oriented = [&] (int s, const Vector2f & oPt, float flip) {
+		Vector2f normalDir(nx[s], ny[s]);
+		Vector2f v = Vector2f(mx[s], my[s]) - oPt;
+		if (flip*(v.y()*normalDir.x() - v.x()*normalDir.y()) > 0)
+			normalDir = -normalDir;
+		return normalDir;
+	};
+
+	for (int i=0; i<nPoints; i++) {
+		const Vector2f & center = pts[i];
+		Vector2f v1 = Oriented(i, center, -1);
+		Vector2f v2 = Oriented((i+curvatureSize)%nPoints, center, 1);
+		Vector2f normalDir((v1+v2).normalized());
+
+		// Compute angle
+		float val = v1.dot(v2);
+		if (val < -1) val = -1;
+		if (val > 1) val = 1;
+		angles[i] = acos(val);
+
+		// Least squares parabola y = ax^2 + bx + c through the normal equations
+		double p[5] = {0, 0, 0, 0, 0}, q[3] = {0, 0, 0};
+		for (int j=i-curvatureSize; j<=i+curvatureSize; j++) {
+			Vector2f l(pts[(j+nPoints)%nPoints]-center);
+			float y = normalDir.dot(l);
+			float x = sqrt(abs(l.squaredNorm() - y*y));
+			if (normalDir.x()*l.y() - normalDir.y()*l.x() < 0) x = -x;
+			double x2 = (double)x*x;
+			p[0] += 1; p[1] += x; p[2] += x2; p[3] += x2*x; p[4] += x2*x2;
+			q[0] += y; q[1] += x*y; q[2] += x2*y;
+		}
+		Matrix3d A;
+		A << p[4], p[3], p[2],
+			 p[3], p[2], p[1],
+			 p[2], p[1], p[0];
+		Vector3d curveInfo = JacobiSVD<Matrix3d>(A, ComputeFullU | ComputeFullV).solve(Vector3d(q[2], q[1], q[0]));
+		curvatures[i] = (float)(2*curveInfo.x()/pow(1+curveInfo.y()*curveInfo.y(), 1.5));
+	}
+}
+
+void JPuzzle::ProcessPuzzlePiece(PuzzlePiece & piece, Texture & tex, int edgeInsetLevel)
 {
-	PuzzlePiece & piece = m_PuzzlePieces[m_nPuzzlePieces-1];
-	piece.index = m_nPuzzlePieces-1;
-	char buf[256];
-	sprintf(buf, "\n%i\n", m_nPuzzlePieces);
-	OutputDebugStringA(buf);
 
 	/* Find pixels on boundary */
 	int i=tex.height/2, j=0;
 	for (; j<tex.width; j++) {
 		if (tex(i, j).w() > 0) break;
 	}
-	//j -= 1;
 	int startX = j;
 	int startY = i;
 	if (startX >= tex.width-1)
 		DebugBreak();
 
-	int * used = new int[tex.width*tex.height];
-	memset(used, 0, sizeof(int)*tex.width*tex.height);
-
-	/*D3D10_MAPPED_TEXTURE2D mappedTex;
-	ID3D10Texture2D * pTexture;
-	piece.SRVPuzzleTexture->GetResource((ID3D10Resource**)&pTexture);
-	pTexture->Map(D3D10CalcSubresource(0, 0, 1), D3D10_MAP_WRITE_DISCARD, 0, &mappedTex);
-	UCHAR* pTexels = (UCHAR*)mappedTex.pData;*/
+	/* Moore-neighbour trace. The neighbours of the current pixel are scanned
+	   clockwise starting after the transparent pixel we came from, so every
+	   step is O(1) and nothing is ever undone. Since the next step depends only
+	   on the pixel and that scan, the walk is closed once it leaves the start
+	   pixel the same way it first did (Jacob's rule on the outgoing move, which
+	   also holds when the start is re-entered from another side). */
+	static const int dirX[8] = {-1,-1, 0, 1, 1, 1, 0,-1};
+	static const int dirY[8] = { 0,-1,-1,-1, 0, 1, 1, 1};
+	static const int dirIndex[3][3] = {{1, 2, 3}, {0, -1, 4}, {7, 6, 5}};	// [dy+1][dx+1]
+	auto Opaque = [&tex] (int y, int x) {
+		return tex.Inside(y, x) && tex(y, x).w() > 0;
+	};
 	std::vector<Vector2f> pixelBoundaryPos;
-	//std::vector<Vector2f> boundaryPos;
-	std::vector<Vector2f> tmpBoundaryPos;
-	bool popped = 0;
-
-	auto IsAtStart = [] (int i, int j, int startX, int startY) {
-		return (i+1==startY && j==startX || i-1==startY && j==startX || i==startY && j+1==startX || i==startY && j-1==startX ||
-			i+1==startY && j+1==startX || i-1==startY && j+1==startX || i+1==startY && j-1==startX || i-1==startY && j-1==startX);
+	std::vector<Vector2i> boundaryPixels;
+	auto AddPoint = [&] (int y, int x, int back) {
+		// Drop the tip of one pixel wide spurs instead of walking back over them
+		int n = boundaryPixels.size();
+		if (n >= 2 && boundaryPixels[n-2] == Vector2i(x, y)) {
+			boundaryPixels.pop_back();
+			pixelBoundaryPos.pop_back();
+			return;
+		}
+		Vector2f pos(x, y);
+		if (m_SubPixelContour) {
+			// Move the point out towards the transparent side by its coverage
+			Vector2f outward = Vector2f(dirX[back], dirY[back]).normalized();
+			pos += (tex(y, x).w()/255.f - .5f)*outward;
+		}
+		boundaryPixels.push_back(Vector2i(x, y));
+		pixelBoundaryPos.push_back(pos);
 	};
 
-	for (; ;) {
-		if (!popped) {
-			pixelBoundaryPos.push_back(Vector2f(j, i));
-			tmpBoundaryPos.push_back(Vector2f(j, i));
-		}
-		popped = 0;
-		used[tex.width*i + j] = pixelBoundaryPos.size()+1;
-
-		/*if (edgeInsetLevel == 2) {
-			UINT rowStart = (int)pixelBoundaryPos.back().y() * mappedTex.RowPitch;
-			UINT colStart =  (int)pixelBoundaryPos.back().x() * 4;
-			pTexels[rowStart + colStart + 0] = 255*edgeInsetLevel;
-			pTexels[rowStart + colStart + 1] = 255;
-			pTexels[rowStart + colStart + 2] = 0; 
-			pTexels[rowStart + colStart + 3] = 255;
-		}//*/
-		
-		if (pixelBoundaryPos.size() > 10 && IsAtStart(i, j, startX, startY))
-			break;
-
-		int x=-1,y=-1;
-		if (OnBoundary(i+1, j, tex) && !used[tex.width*(i+1) + j]) y=i+1,x=j;
-		else if (OnBoundary(i-1, j, tex) && !used[tex.width*(i-1) + j]) y=i-1,x=j;
-		else if (OnBoundary(i, j+1, tex) && !used[tex.width*(i) + j+1]) y=i,x=j+1;
-		else if (OnBoundary(i, j-1, tex) && !used[tex.width*(i) + j-1]) y=i,x=j-1;
-		else if (OnBoundary(i+1, j+1, tex) && !used[tex.width*(i+1) + j+1]) y=i+1,x=j+1;
-		else if (OnBoundary(i-1, j+1, tex) && !used[tex.width*(i-1) + j+1]) y=i-1,x=j+1;
-		else if (OnBoundary(i+1, j-1, tex) && !used[tex.width*(i+1) + j-1]) y=i+1,x=j-1;
-		else if (OnBoundary(i-1, j-1, tex) && !used[tex.width*(i-1) + j-1]) y=i-1,x=j-1;
-		/*if (OnOutsideBoundary(i+1, j, tex) && !used[tex.width*(i+1) + j]) y=i+1,x=j;
-		else if (OnOutsideBoundary(i-1, j, tex) && !used[tex.width*(i-1) + j]) y=i-1,x=j;
-		else if (OnOutsideBoundary(i, j+1, tex) && !used[tex.width*(i) + j+1]) y=i,x=j+1;
-		else if (OnOutsideBoundary(i, j-1, tex) && !used[tex.width*(i) + j-1]) y=i,x=j-1;
-		else if (OnOutsideBoundary(i+1, j+1, tex) && !used[tex.width*(i+1) + j+1]) y=i+1,x=j+1;
-		else if (OnOutsideBoundary(i-1, j+1, tex) && !used[tex.width*(i-1) + j+1]) y=i-1,x=j+1;
-		else if (OnOutsideBoundary(i+1, j-1, tex) && !used[tex.width*(i+1) + j-1]) y=i+1,x=j-1;
-		else if (OnOutsideBoundary(i-1, j-1, tex) && !used[tex.width*(i-1) + j-1]) y=i-1,x=j-1;*/
-		else { // back track
-			if (pixelBoundaryPos.size() > 10 && (
-				IsAtStart(i, j, pixelBoundaryPos[1].x(), pixelBoundaryPos[1].y()) || 
-				IsAtStart(i, j, pixelBoundaryPos[2].x(), pixelBoundaryPos[2].y()) ))
-				break;
-
-			pixelBoundaryPos.pop_back();
-			if (pixelBoundaryPos.size() == 0)  {
-				
-				for (int i=0; i<4; i++) {
-					int s = piece.edgeColors[i][edgeInsetLevel-1].size();
-					piece.edgeColors[i][edgeInsetLevel].resize(s);
-					memcpy(piece.edgeColors[i][edgeInsetLevel].data(), piece.edgeColors[i][edgeInsetLevel-1].data(), sizeof(Color)*s);
-				}
-				
-				delete[] used;
-				//pTexture->Unmap(D3D10CalcSubresource(0, 0, 1));
-				return;
-				DebugBreak();
-			}
-			y = (int)pixelBoundaryPos.back().y();
-			x = (int)pixelBoundaryPos.back().x();
-			popped=1;
-			
+	int back = 0, firstNext = -1;
+	AddPoint(i, j, back);
+	for (;;) {
+		int next = -1;
+		for (int s=1; s<=8; s++) {
+			int d = (back+s)%8;
+			if (Opaque(i+dirY[d], j+dirX[d])) { next = d; break; }
+		}
+		if (next < 0) break;	// isolated pixel
+		if (i == startY && j == startX) {
+			if (firstNext == next) break;
+			if (firstNext < 0) firstNext = next;
 		}
 
+		int prev = (next+7)%8;
+		int y = i+dirY[next], x = j+dirX[next];
+		back = dirIndex[i+dirY[prev]-y+1][j+dirX[prev]-x+1];
 		i = y;
 		j = x;
+		AddPoint(i, j, back);
+	}
+	// The walk ends back on the start pixel
+	if (boundaryPixels.size() > 1 && boundaryPixels.back() == boundaryPixels.front()) {
+		boundaryPixels.pop_back();
+		pixelBoundaryPos.pop_back();
+	}
+
+	/* Nothing left worth tracing at this inset, reuse the previous layer */
+	if (boundaryPixels.size() < 12) {
+		if (edgeInsetLevel == 0)
+			DebugBreak();
+		for (int i=0; i<4; i++)
+			piece.edgeColors[i][edgeInsetLevel] = piece.edgeColors[i][edgeInsetLevel-1];
+		return;
 	}
-	delete[] used;
 	int nPoints = pixelBoundaryPos.size();
 
 	/* Correct orientation */
@@ -515,9 +1004,8 @@ void JPuzzle::ProcessPuzzlePiece(Texture & tex, int edgeInsetLevel, ID3D10Device
 		
 		if (e2.x()*e1.y() - e2.y()*e1.x() < 0) {
 			for (int i=0; i<nPoints/2; i++) {
-				Vector2f t(pixelBoundaryPos[i]);
-				pixelBoundaryPos[i] = pixelBoundaryPos[nPoints-i-1];
-				pixelBoundaryPos[nPoints-i-1] = t;
+				std::swap(pixelBoundaryPos[i], pixelBoundaryPos[nPoints-i-1]);
+				std::swap(boundaryPixels[i], boundaryPixels[nPoints-i-1]);
 
 				/*t = (boundaryPos[i]);
 				boundaryPos[i] = boundaryPos[nPoints-i-1];
@@ -529,123 +1017,8 @@ void JPuzzle::ProcessPuzzlePiece(Texture & tex, int edgeInsetLevel, ID3D10Device
 	/* Compute curvatures */
 	std::vector<float> curvatures;
 	std::vector<float> angles;
-	if (edgeInsetLevel == 0) {
-		curvatures.resize(nPoints);
-		angles.resize(nPoints);
-		const int curvatureSize=7;
-		Matrix2f M;
-		Vector2f avgPt;
-		MatrixXf curvaturePtsX(2*(curvatureSize+1)-1, 3);
-		VectorXf curvaturePtsY(2*(curvatureSize+1)-1);
-		std::ofstream out("out.txt");
-		int special = 580007;//nPoints-232-1;
-		auto ComputeNormalDirection = [&] (Vector2f oPt, float flip) {
-			avgPt /= curvatureSize+1;
-			M = (M - (curvatureSize+1)*avgPt*avgPt.transpose())/(curvatureSize+1);
-		
-			EigenSolver<Matrix2f> eig(M);
-			Vector2f normalDir;
-			Matrix2f vectors = eig.pseudoEigenvectors();
-			if (eig.eigenvalues()[0].real() > eig.eigenvalues()[1].real())
-				 normalDir = vectors.col(1);
-			else normalDir = vectors.col(0);
-
-			Vector2f v = avgPt - oPt;
-			if (flip*(v.y()*normalDir.x() - v.x()*normalDir.y()) > 0)
-				normalDir = -normalDir;
-
-			return normalDir;
-		};
-		for (int i=0; i<nPoints; i++) {
-			M = Matrix2Xf::Zero(2,2);
-			avgPt = Vector2f::Zero(2);
-		
-			// Compute normal direction
-			for (int j=i-curvatureSize; j<=i; j++) {
-				int index = j < 0 ? nPoints+j : j;
-				M += pixelBoundaryPos[index] * pixelBoundaryPos[index].transpose();
-				avgPt += pixelBoundaryPos[index];
-				//if (i == special)
-				//	out << pixelBoundaryPos[index].x() << ' ' << pixelBoundaryPos[index].y()  << std::endl;
-			}
-			Vector2f v1 = ComputeNormalDirection(pixelBoundaryPos[i < 0 ? nPoints+i : i], -1);
-
-			M = Matrix2Xf::Zero(2,2);
-			avgPt = Vector2f::Zero(2);
-			for (int j=i; j<=(i+curvatureSize); j++) {
-				int index = j%nPoints;
-				M += pixelBoundaryPos[index] * pixelBoundaryPos[index].transpose();
-				avgPt += pixelBoundaryPos[index];
-				//if (i == special)
-				//	out << pixelBoundaryPos[index].x() << ' ' << pixelBoundaryPos[index].y()  << std::endl;
-			}
-			Vector2f v2 = ComputeNormalDirection(pixelBoundaryPos[i%nPoints], 1);
-			Vector2f normalDir((v1+v2).normalized());
-		
-			// Compute angle
-			float val = v1.dot(v2);
-			if (val < -1) val = -1;
-			if (val > 1) val = 1;
-			val = acos(val);
-			angles[i] = val;
-
-			// Compute curvature
-			int count = 0;
-			Vector2f center(pixelBoundaryPos[i]);
-			for (int j=i-curvatureSize; j<=i; j++) {
-				int index = j < 0 ? nPoints+j : j;
-				Vector2f l(pixelBoundaryPos[index]-center);
-				float y = normalDir.dot(l);
-				float x = sqrt(abs(l.squaredNorm() - y*y));
-				if (normalDir.x()*l.y() - normalDir.y()*l.x() < 0) x = -x;
-				curvaturePtsX(count, 0) = x*x;
-				curvaturePtsX(count, 1) = x;
-				curvaturePtsX(count, 2) = 1;
-				curvaturePtsY(count++) = y;
-			}
-	
-			for (int j=i+1; j<=(i+curvatureSize); j++) {
-				int index = j%nPoints;
-				Vector2f l(pixelBoundaryPos[index]-center);
-				float y = normalDir.dot(l);
-				float x = sqrt(abs(l.squaredNorm() - y*y));
-				if (normalDir.x()*l.y() - normalDir.y()*l.x() < 0) x = -x;
-				curvaturePtsX(count, 0) = x*x;
-				curvaturePtsX(count, 1) = x;
-				curvaturePtsX(count, 2) = 1;
-				curvaturePtsY(count++) = y;
-			}
-		
-			Vector3f curveInfo = curvaturePtsX.jacobiSvd(ComputeThinU | ComputeThinV).solve(curvaturePtsY);		
-			float curvatureVal = 2*curveInfo.x()/pow(1+curveInfo.y()*curveInfo.y(), 1.5);
-
-			if (i == special) {
-				//out << v2 << std::endl << std::endl;
-				//out << v1.dot(v2) << std::endl;
-				float flt = v1.dot(v2); 
-				//out << val << std::endl;
-				//out << abs(.5f*D3DX_PI - val) << std::endl << std::endl;
-			}
-
-			curvatures[i] = curvatureVal;
-			//out << curvatures[i] << std::endl;
-		} //*/ 
-	
-		/*
-		for (int i=0; i<nPoints; i++) {
-			if (curvatures[i] < 0) {
-				UINT rowStart = (int)pixelBoundaryPos[i].y() * mappedTex.RowPitch;
-				UINT colStart =  (int)pixelBoundaryPos[i].x() * 4;
-				pTexels[rowStart + colStart + 0] = 0;
-				pTexels[rowStart + colStart + 1] = 0;
-				pTexels[rowStart + colStart + 2] = 0; 
-				pTexels[rowStart + colStart + 3] = 255;
-			}
-
-		}
-		pTexture->Unmap(D3D10CalcSubresource(0, 0, 1));
-		return;*/
-	}
+	if (edgeInsetLevel == 0)
+		ComputeCurvatures(pixelBoundaryPos, curvatures, angles);
 
 	/* Find the corner points */
 	auto findClosestPt = [edgeInsetLevel, nPoints,&pixelBoundaryPos,&angles] (Vector2f & pt, Vector2f & offset) {
@@ -697,8 +1070,8 @@ void JPuzzle::ProcessPuzzlePiece(Texture & tex, int edgeInsetLevel, ID3D10Device
 			for (int j=endPoints[i], count=0; j!=endPoints[(i+1)%4]; j=(j+1)%nPoints, count++) {
 				
 				//piece.edgeColors[i][edgeInsetLevel][count] = tex(pixelBoundaryPos[j].y(), pixelBoundaryPos[j].x());
-				piece.edgeColors[i][edgeInsetLevel][count] = tex(pixelBoundaryPos[j].y(), pixelBoundaryPos[j].x());
-				tex(pixelBoundaryPos[j].y(), pixelBoundaryPos[j].x()).w() = 0;
+				piece.edgeColors[i][edgeInsetLevel][count] = tex(boundaryPixels[j].y(), boundaryPixels[j].x());
+				tex(boundaryPixels[j].y(), boundaryPixels[j].x()).w() = 0;
 
 				/*if (edgeInsetLevel==3) {
 				UINT rowStart = (int)(pixelBoundaryPos[j].y()) * mappedTex.RowPitch;
@@ -766,9 +1139,10 @@ void JPuzzle::ProcessPuzzlePiece(Texture & tex, int edgeInsetLevel, ID3D10Device
 		piece.edgeColors[i][edgeInsetLevel].resize(edges[i].size());
 		for (int j=0; j<edges[i].size(); j++) {
 			// Assign color
-			piece.edgeColors[i][edgeInsetLevel][j] = tex(edges[i][j].pos.y(), edges[i][j].pos.x());
+			Vector2i & pixel = boundaryPixels[(endPoints[i]+j)%nPoints];
+			piece.edgeColors[i][edgeInsetLevel][j] = tex(pixel.y(), pixel.x());
 			//piece.edgeColors[i][edgeInsetLevel][j] = tex(edges[i][j].pos.y(), edges[i][j].pos.x());
-			tex(edges[i][j].pos.y(), edges[i][j].pos.x()).w() = 0;
+			tex(pixel.y(), pixel.x()).w() = 0;
 
 			// Compute total curvature and len 
 			piece.totalCurvature[i] += abs(edges[i][j].k);
@@ -852,8 +1226,12 @@ void JPuzzle::AddPiece()
 {
 	//border pieces
 	if (m_nPiecesAdded == 1) {
-		//AssemblyBorder();
-		AssemblyBorderMST();
+		if (m_BorderAssembly == BorderFromDimension)
+			AssemblyBorderFindDimension();
+		else if (m_BorderAssembly == BorderFromChain)
+			AssemblyBorder();
+		else
+			AssemblyBorderMST();
 		//AssemblyBorderWithDimension(3,9);//puzzle 2
 		//AssemblyBorderWithDimension(13,7);//puzzle 6
 		//AssemblyBorderWithDimension(11,17);//puzzle 7
@@ -864,7 +1242,15 @@ void JPuzzle::AddPiece()
 	//inner pieces
 	else if (m_nPiecesAdded+1 <= m_nPuzzlePieces) {
 		m_nPiecesAdded++;
+#ifdef JPUZZLE_TRACK_ALLOCATIONS
+		unsigned long long allocations = AllocationCount();
+		ComparePieces();
+		char buf[64];
+		sprintf(buf, "step %i: %llu allocations\n", m_nPiecesAdded, AllocationCount()-allocations);
+		OutputDebugStringA(buf);
+#else
 		ComparePieces();
+#endif
 		//MatchPocket(FindPockets());
 		
 	}
@@ -897,7 +1283,7 @@ void JPuzzle::AssemblyBorder()
 				links[0].b = *it_r;
 				links[0].k = rightIdx;
 				links[0].l = leftIdx;
-				if(CompareEdgesByShape(links) < 3.5)
+				if(EdgesCompatible(*links[0].a, links[0].k, *links[0].b, links[0].l) && CompareEdgesByShape(links) < 3.5)
 					row.push_back(CompareEdgesByColor(links));
 				else
 					row.push_back(100000);
@@ -905,518 +1291,330 @@ void JPuzzle::AssemblyBorder()
 			}
 			assignMatrix.push_back(row);
 		}
+		/* The chain grows at the end whose best candidate stands out more from
+		   its second best. Pieces in the chain are flagged in used. Every end
+		   keeps its candidates in a heap, built once when the piece becomes an
+		   end and popped past the used ones, so an extension costs O(log n). */
+		int n = borderPieces.size();
+		std::vector<bool> used(n, false);
+		std::vector<std::vector<int> > candidates[2];	// [0] to the left of a piece, [1] to the right
+		for (int side=0; side<2; side++)
+			candidates[side].resize(n);
+		auto BestTwo = [&] (int end, int side, float & min, float & second_min) -> int {
+			std::vector<int> & heap = candidates[side][end];
+			auto Score = [&] (int i) { return side == 0 ? assignMatrix[end][i] : assignMatrix[i][end]; };
+			// Equal scores go to the lower index, as the scan over the row did
+			auto Worse = [&] (int i, int j) { return Score(i) > Score(j) || (Score(i) == Score(j) && i > j); };
+			if (heap.empty()) {
+				for (int i=0; i<n; i++)
+					if (!used[i]) heap.push_back(i);
+				std::make_heap(heap.begin(), heap.end(), Worse);
+			}
+			while (!heap.empty() && used[heap.front()]) {
+				std::pop_heap(heap.begin(), heap.end(), Worse);
+				heap.pop_back();
+			}
+			min = second_min = FLT_MAX;
+			if (heap.empty())
+				return -1;
+			int minidx = heap.front();
+			min = Score(minidx);
+			std::pop_heap(heap.begin(), heap.end(), Worse);
+			heap.pop_back();
+			while (!heap.empty() && used[heap.front()]) {
+				std::pop_heap(heap.begin(), heap.end(), Worse);
+				heap.pop_back();
+			}
+			if (!heap.empty())
+				second_min = Score(heap.front());
+			heap.push_back(minidx);
+			std::push_heap(heap.begin(), heap.end(), Worse);
+			return minidx;
+		};
+
 		std::list<int> assignment;
 	
 		assignment.push_back(startidx);
-		while (assignment.size() <borderPieces.size()-1){
-			
-			//extend to the left
-			int idxL = assignment.back();
-			std::vector<float> row = assignMatrix[idxL];
-			float min = FLT_MAX;
-			float second_min = FLT_MAX;
-			int minidx = -1;
-			for (int i = 0; i<row.size(); ++i) {
-				if (idxL == i)
-					continue;
-				bool found = false;
-				for (std::list<int>::iterator j = assignment.begin(); j != assignment.end(); ++j){
-					if (i == *j){
-						found = true;
-						break;
-					}
-				}
-				if (found)
-					continue;
+		used[startidx] = true;
+		while (assignment.size() < n){
+			float min, second_min;
 
-				if (row[i] < min){
-					second_min = min;
-					min = row[i];
-					minidx = i;
-				}
-				else if (row[i] < second_min){
-					second_min = row[i];
-				}
-			}
+			//extend to the left
+			int minidx = BestTwo(assignment.back(), 0, min, second_min);
 			float confidence = min / second_min;
 
 			//extend to the right
-			int idxR = assignment.front();
-			min = FLT_MAX;
-			second_min = FLT_MAX;
-			int minidxR = -1;
-			for (int i = 0; i<assignMatrix.size(); ++i) {
-				if (idxR == i)
-					continue;
-				bool found = false;
-				for (std::list<int>::iterator j = assignment.begin(); j != assignment.end(); ++j){
-					if (i == *j){
-						found = true;
-						break;
-					}
-
-				}
-				if (found)
-					continue;
-
-				if (assignMatrix[i][idxR] < min){
-					second_min = min;
-					min = assignMatrix[i][idxR];
-					minidxR = i;
-				}
-				else if (assignMatrix[i][idxR] < second_min){
-					second_min = assignMatrix[i][idxR];
-				}
-			}
+			int minidxR = BestTwo(assignment.front(), 1, min, second_min);
 
 			if ((min / second_min) > confidence){
-				//idx = minidx;
 				assignment.push_back(minidx);
+				used[minidx] = true;
 			}
 			else{
-				//idx = minidxR;
 				assignment.push_front(minidxR);
-				startidx++;
-			}
-
-		}
-		for (int i = 0; i<assignMatrix.size(); ++i) {
-			bool found = false;
-			for (std::list<int>::iterator j = assignment.begin(); j != assignment.end(); ++j){
-					if (i == *j){
-						found = true;
-						break;
-					}
-			}
-			if(!found){
-				int idxR = assignment.front();
-				int idxL = assignment.back();
-				if(assignMatrix[idxL][i] < assignMatrix[i][idxR])
-					assignment.push_back(i);
-				else{
-					assignment.push_front(i);
-					startidx++;
-				}
-				break;
+				used[minidxR] = true;
 			}
 		}
 
-		std::list<int>::iterator it = assignment.begin();
-		std::advance(it, startidx);
-		
-		std::list<int>::iterator it_left = it;
-		std::list<int>::iterator it_right = it;
-		while (m_nPiecesAdded < borderPieces.size()){
-			EdgeLinkInfo measure;
-			if(++it_left != assignment.end()){
-				measure.a = borderPieces[*(--it_left)];
-				measure.b = borderPieces[*(++it_left)];
-				measure.k = (measure.a)->left();
-				measure.l = (measure.b)->right();			
-				//float measure;
-				for (int i = 0; i < m_NotAddedPuzzlePieces.size(); ++i){
-					if (measure.b == m_NotAddedPuzzlePieces[i]){
-						//measure.j = i;
-						break;
-					}
-				}
-				MovePiece(measure);
-				measure.a->adjPieces[measure.k] = measure.b;
-				measure.a->edgeCovered[measure.k] = 1;
-				measure.b->adjPieces[measure.l] = measure.a;
-				measure.b->edgeCovered[measure.l] = 1;
-				measure.b->isAdded = 1;
-				m_nPiecesAdded++;
-			}
-			if(it_left == assignment.end())
-				--it_left;
-			if(it_right != assignment.begin()){
-				measure.a = borderPieces[*(it_right)];
-				measure.b = borderPieces[*(--it_right)];
-				measure.k = (measure.a)->right();
-				measure.l = (measure.b)->left();			
-				//float measure;
-				for (int i = 0; i < m_NotAddedPuzzlePieces.size(); ++i){
-					if (measure.b == m_NotAddedPuzzlePieces[i]){
-						//measure.j = i;
-						break;
-					}
-				}
-				MovePiece(measure);
-				measure.a->adjPieces[measure.k] = measure.b;
-				measure.a->edgeCovered[measure.k] = 1;
-				measure.b->adjPieces[measure.l] = measure.a;
-				measure.b->edgeCovered[measure.l] = 1;
-				measure.b->isAdded = 1;
-				m_nPiecesAdded++;
-			}
-			  
-		}
-
-		PuzzlePiece * toLink[2] = {0,0};
-		for (int i=0, count=0; i<m_nPiecesAdded; i++) {
-			int sum=0;
-			for (int j=0; j<4; j++)
-				sum += m_AddedPuzzlePieces[i]->adjPieces[j] ? 1 : 0;
-			if (sum == 1)
-				toLink[count++] = m_AddedPuzzlePieces[i];
-		}
-		
-		int edgeIndices[2];
-		for (int i=0; i<2; i++) {
-			int sum = (int)toLink[i]->edgeIsBorder[0]+(int)toLink[i]->edgeIsBorder[1]+
-				(int)toLink[i]->edgeIsBorder[2]+(int)toLink[i]->edgeIsBorder[3];
-			if (sum == 1) {
-				int index=0;
-				for (; toLink[i]->adjPieces[index] == NULL; index++) {}
-				edgeIndices[i] = (index+2)%4;
-			} else {
-				edgeIndices[i] = 0;
-				for (; toLink[i]->adjPieces[edgeIndices[i]] != NULL || toLink[i]->edgeIsBorder[edgeIndices[i]]; edgeIndices[i]++) {}
+		/* Greedy growth knows nothing about corners, so the chain is only placed
+		   when it closes into a frame of a size the border allows. Otherwise the
+		   strips decide. */
+		int sides = n/2+2;
+		for (int w=2; w<=sides-2; w++) {
+			if (n%2 == 0 && BorderRingFits(w, sides-w, borderPieces, assignment)) {
+				PlaceBorderRing(borderPieces, assignment);
+				return;
 			}
 		}
-		for (int i=0; i<2; i++) {
-			toLink[i]->adjPieces[edgeIndices[i]] = toLink[(i+1)%2];
-			toLink[i]->edgeCovered[edgeIndices[i]] = 1;
-		}
-
-		/*
-		PuzzlePiece * previous = m_AddedPuzzlePieces[2];
-		PuzzlePiece * next = m_AddedPuzzlePieces[0];
-		while (next != NULL) {
-			char buf[256];
-			sprintf(buf, "\n%i\n", next->index);
-			OutputDebugStringA(buf);
-			bool notFound=1;
-			for (int i=3; i>=0; i--)  {
-				if (next->adjPieces[i] != NULL && next->adjPieces[i] != previous) {
-					previous = next;
-					next = next->adjPieces[i];
-					notFound=0;
-					break;
-				}
-			}
-			if(notFound) break;
-
-		}*/
+		AssemblyBorderMST();
+}
 
-		// Link first piece with last piece
-		/*int firstEdgeIndex=0, lastEdgeIndex=0;
-		while (m_AddedPuzzlePieces[0]->edgeCovered[firstEdgeIndex]) firstEdgeIndex++;
-		while (m_AddedPuzzlePieces[m_nPiecesAdded-1]->edgeIsBorder[lastEdgeIndex]) lastEdgeIndex++;
-		if (m_AddedPuzzlePieces[m_nPiecesAdded-1]->edgeCovered[(lastEdgeIndex+1)%4]) 
-			lastEdgeIndex = lastEdgeIndex-1 < 0 ? 3 : lastEdgeIndex-1;
-		m_AddedPuzzlePieces[0]->adjPieces[firstEdgeIndex] = m_AddedPuzzlePieces[m_nPiecesAdded-1];
-		m_AddedPuzzlePieces[0]->edgeCovered[firstEdgeIndex] = 1;
-		m_AddedPuzzlePieces[m_nPiecesAdded-1]->adjPieces[lastEdgeIndex] = m_AddedPuzzlePieces[0];
-		m_AddedPuzzlePieces[m_nPiecesAdded-1]->edgeCovered[lastEdgeIndex] = 1;*/
+// Corners at c0<c1<c2<c3 of a ring of total pieces need c1-c0 == c3-c2 and
+// c2-c1 == total+c0-c3, so the first two fix where the other two go. Checks
+// what the first count pieces already decide.
+static bool BorderCornersFit(const std::vector<int>& corners, int count, int total)
+{
+	if (corners.size() < 2)
+		return true;
+	if (corners.size() > 4)
+		return false;
+	int w = corners[1]-corners[0];
+	int h = total/2-w;
+	if (total%2 || h <= 0)
+		return false;
+	int expected[4] = {corners[0], corners[1], corners[1]+h, corners[1]+h+w};
+	for (int i=2; i<corners.size(); i++)
+		if (corners[i] != expected[i]) return false;
+	return corners.size() == 4 || count-1 < expected[corners.size()];
 }
 
-//first call: pool[0] is added; recursiveBorder[0] = 0;
-void JPuzzle::borderStripSearch(float& globalMin, float recursiveMin, std::vector<BorderStrip>& pool, std::list<int>& recursiveBorder, std::vector<std::list<int>>& optBorder, int length) {
-	if(recursiveMin > globalMin || length==0)
+//first call: pool[0] is added; search.ring = {0}
+void JPuzzle::borderStripSearch(BorderStripSearch& search, std::vector<BorderStrip>& pool, float cost, float bound, int length) {
+	if (search.nodes++ > m_BorderSearchNodes)
 		return;
-	if (length==1){
-			for (int i = 0; i<pool.size(); ++i) {
-				if(pool[i].isAdded==1)
-					continue;
-				//found the last one
-				//check dimension
-				recursiveBorder.push_back(i);
-				std::vector<int> corners;
-				int count = 0;
-				for(std::list<int>::iterator it = recursiveBorder.begin(); it!=recursiveBorder.end(); ++it) {
-					for(std::list<PuzzlePiece*>::iterator it_p = pool[*it].pieces.begin(); it_p != pool[*it].pieces.end(); ++it_p){
-						if((*it_p)->borders().size()==2){
-							corners.push_back(count);
-						}
-						count++;
-					}
-				}
-				assert(corners.size()==4);
-				int w = corners[1] - corners[0];
-				int h = corners[2] - corners[1];
-				if(corners[3]-corners[2] != w){
-					recursiveBorder.pop_back();
-					return;
-				}
-				if(count+corners[0]-corners[3] != h){
-					recursiveBorder.pop_back();
-					return;
-				}
-				//left-right
-				/*int leftIdx = pool[recursiveBorder.back()].pieces.back()->left();
-				int rightIdx = pool[i].pieces.front()->right();
-				std::vector<EdgeLinkInfo> links; links.resize(1);
-				links[0].a = pool[i].pieces.front();
-				links[0].b = pool[recursiveBorder.back()].pieces.back();
-				links[0].k = rightIdx;
-				links[0].l = leftIdx;
-				//if(CompareEdgesByShape(links) < 3.5)
-				float c1 = CompareEdgesByColor(links);
-			    
-				if(c1+recursiveMin >= globalMin){
-					recursiveBorder.pop_back();
-						return;
-				}
-
-				leftIdx = pool[i].pieces.back()->left();
-				rightIdx = pool[0].pieces.front()->right();
-				links[0].a = pool[0].pieces.front();
-				links[0].b = pool[i].pieces.back();
-				links[0].k = rightIdx;
-				links[0].l = leftIdx;
-				//if(CompareEdgesByShape(links) < 3.5)
-				float c2 = CompareEdgesByColor(links);*/
-				//if(c1+c2+recursiveMin < globalMin){
-					//globalMin = recursiveMin+c1+c2;
-					
-					optBorder.push_back(recursiveBorder);
-					recursiveBorder.pop_back();
-					return;
-				//}
-				//recursiveBorder.pop_back();
-			}
-			
+	int last = search.ring.back();
+	bool full = search.best.size() == m_BorderRings;
+	if (length == 0) {
+		float ringCost = cost + search.joint[last][0];
+		if ((full && ringCost >= search.best.front().cost) || search.ringCorners.size() != 4)
 			return;
+		if (full) {
+			std::pop_heap(search.best.begin(), search.best.end());
+			search.best.pop_back();
 		}
+		BorderRing ring = {ringCost, search.ring};
+		search.best.push_back(ring);
+		std::push_heap(search.best.begin(), search.best.end());
+		return;
+	}
 
-	for(int i=0; i<pool.size(); ++i) {
-			if(!pool[i].isAdded){
-				
-				int leftIdx = pool[recursiveBorder.back()].pieces.back()->left();
-				int rightIdx = pool[i].pieces.front()->right();
-				/*std::vector<EdgeLinkInfo> links; links.resize(1);
-				links[0].a = pool[i].pieces.front();
-				links[0].b = pool[recursiveBorder.back()].pieces.back();
-				links[0].k = rightIdx;
-				links[0].l = leftIdx;
-				float c = CompareEdgesByColor(links);
-				*/
-				pool[i].isAdded=true;
-				recursiveBorder.push_back(i);
-				borderStripSearch(globalMin, recursiveMin , pool, recursiveBorder, optBorder, length-1);
-				pool[i].isAdded = false;
-				recursiveBorder.pop_back();
+	// Cheapest joints first, so good rings tighten the bound early
+	std::vector<std::pair<float, int> > order;
+	for (int i=0; i<pool.size(); ++i)
+		if (!pool[i].isAdded)
+			order.push_back(std::make_pair(search.joint[last][i], i));
+	std::sort(order.begin(), order.end());
+
+	for (int o=0; o<order.size(); ++o) {
+		int i = order[o].second;
+		float next = cost + order[o].first;
+		float nextBound = bound - search.cheapestJoint[i];
+		if (search.best.size() == m_BorderRings && next + nextBound >= search.best.front().cost)
+			continue;
+		int nCorners = search.ringCorners.size();
+		for (int c=0; c<search.corners[i].size(); ++c)
+			search.ringCorners.push_back(search.ringPieces + search.corners[i][c]);
+		search.ringPieces += search.nPieces[i];
+		if (BorderCornersFit(search.ringCorners, search.ringPieces, search.total)) {
+			pool[i].isAdded = true;
+			search.ring.push_back(i);
+			borderStripSearch(search, pool, next, nextBound, length-1);
+			search.ring.pop_back();
+			pool[i].isAdded = false;
+		}
+		search.ringPieces -= search.nPieces[i];
+		search.ringCorners.resize(nCorners);
+	}
+}
 
-			}
+void JPuzzle::LayOutBorderStrips(std::vector<BorderStrip>& strips)
+{
+	for (int i=0; i<strips.size(); i++) {
+		float offset=i*1;
+		int count=0;
+		for (std::list<PuzzlePiece*>::iterator it = strips[i].pieces.begin(); it != strips[i].pieces.end(); ++it){ 
+			(*it)->transform(0, 3) += offset;
+			(*it)->transform(1, 3) +=1*count;count++;
+			m_AddedPuzzlePieces.push_back((*it));
+			m_nPiecesAdded++;
 		}
-		return;
+	}
+}
 
+bool JPuzzle::SearchBorderRing(std::vector<BorderStrip>& strips, BorderStripSearch& search)
+{
+	/* Rings only differ in the joints between strips, the ones inside them are
+	   shared. True when the search ran to the end within m_BorderSearchNodes. */
+	std::vector<EdgeLinkInfo> links(1);
+	int nStrips = strips.size();
+	search = BorderStripSearch();
+	search.joint.assign(nStrips, std::vector<float>(nStrips, FLT_MAX));
+	search.cheapestJoint.assign(nStrips, FLT_MAX);
+	search.corners.resize(nStrips);
+	search.nPieces.resize(nStrips);
+	search.total = 0;
+	for (int i=0; i<nStrips; i++) {
+		int count = 0;
+		for (std::list<PuzzlePiece*>::iterator it_p = strips[i].pieces.begin(); it_p != strips[i].pieces.end(); ++it_p, ++count)
+			if ((*it_p)->nBorders() == 2)
+				search.corners[i].push_back(count);
+		search.nPieces[i] = count;
+		search.total += count;
+		for (int j=0; j<nStrips; j++) {
+			// A single strip closes on itself
+			if (i == j && nStrips > 1)
+				continue;
+			links[0].a = strips[j].pieces.front();
+			links[0].b = strips[i].pieces.back();
+			links[0].k = links[0].a->right();
+			links[0].l = links[0].b->left();
+			search.joint[i][j] = CompareEdgesByShape(links);
+		}
+	}
+	// Every strip is entered once, the first one by the joint closing the ring
+	float bound = 0;
+	for (int j=0; j<nStrips; j++) {
+		for (int i=0; i<nStrips; i++)
+			search.cheapestJoint[j] = min(search.cheapestJoint[j], search.joint[i][j]);
+		bound += search.cheapestJoint[j];
+	}
+	search.ring.push_back(0);
+	search.ringCorners = search.corners[0];
+	search.ringPieces = search.nPieces[0];
+	search.nodes = 0;
+	strips[0].isAdded = true;
+	borderStripSearch(search, strips, 0, bound, nStrips-1);
+	return search.nodes <= m_BorderSearchNodes;
 }
+
 void JPuzzle::AssemblyBorderMST()
 {
 	
 	
 	std::vector<EdgeLinkInfo> links; links.resize(1);
-	std::vector<std::vector<float> > assignMatrix;
 	std::vector<BorderStrip> borderStrips;
-	//MatrixXf mat;
 
-	int startidx = 0;
 	borderStrips.push_back(BorderStrip(m_AddedPuzzlePieces[0]));
 
 	for (std::vector<PuzzlePiece*>::iterator it = m_NotAddedPuzzlePieces.begin(); it != m_NotAddedPuzzlePieces.end(); ++it) {
 		if ((*it)->isBorderPiece){
 			borderStrips.push_back(BorderStrip(*it));
-		}
-	}
-
-	for (std::vector<BorderStrip>::iterator it_r = borderStrips.begin(); it_r != borderStrips.end(); ++it_r) {
-		std::vector<float> row;//row i col j: i lies to the right of j
-		for (std::vector<BorderStrip>::iterator it_c = borderStrips.begin(); it_c != borderStrips.end(); ++it_c) {
-			int leftIdx = it_r->pieces.front()->left();
-			int rightIdx = it_c->pieces.front()->right();
-			links[0].a = it_c->pieces.front();
-			links[0].b = it_r->pieces.front();
-			links[0].k = rightIdx;
-			links[0].l = leftIdx;
-			if(CompareEdgesByShape(links) < 4.5)
-				row.push_back(CompareEdgesByColor(links));
-			else
-				row.push_back(100000);
-			//cout << Sim((*it_)->right(), (*it)->left()) << ' ' << (*it_)->orientation << ' ' << (*it)->orientation << endl;
-		}
-		assignMatrix.push_back(row);
-	}
-	
-	float rc_old = 0;
-	while(borderStrips.size()>9) {
-		float row_confident = 0;
-		int min_i = -1;
-		int min_j = -1;
-		//for each row find the confident
-		for(int i=0; i<assignMatrix.size() ; ++i){
-			float min = 1e5;
-			float second_min = 1e5;
-			int min_col = -1;
-			for(int j=0; j<assignMatrix[i].size(); ++j){
-				if(i==j)
-					continue;
-				if (assignMatrix[i][j] < min) {
-					second_min = min;
-					min = assignMatrix[i][j];
-					min_col = j;
-				} else if(assignMatrix[i][j] < second_min){
-					second_min = assignMatrix[i][j];
-				}
-			}
-			if(/*second_min < 1e5 && */(1-min/second_min) > row_confident){
-				min_i = i;
-				min_j = min_col;
-				row_confident = 1-min/second_min;
-			}
-		}
-		
-		/*
-
-			//extend to the right
-			int idxR = assignment.front();
-			min = FLT_MAX;
-			second_min = FLT_MAX;
-			int minidxR = -1;
-			for (int i = 0; i<assignMatrix.size(); ++i) {
-				if (idxR == i)
-					continue;
-				bool found = false;
-				for (std::list<int>::iterator j = assignment.begin(); j != assignment.end(); ++j){
-					if (i == *j){
-						found = true;
-						break;
-					}
-
-				}
-				if (found)
-					continue;
-
-				if (assignMatrix[i][idxR] < min){
-					second_min = min;
-					min = assignMatrix[i][idxR];
-					minidxR = i;
-				}
-				else if (assignMatrix[i][idxR] < second_min){
-					second_min = assignMatrix[i][idxR];
-				}
-			}
+		}
+	}
 
-			if ((min / second_min) > confidence){
-				//idx = minidx;
-				assignment.push_back(minidx);
-			}
-			else{
-				//idx = minidxR;
-				assignment.push_front(minidxR);
-				startidx++;
-			}
+	int n = borderStrips.size();
+	std::vector<float> assignMatrix(n*n);//row i col j: i lies to the right of j
+	for (int r=0; r<n; r++) {
+		for (int c=0; c<n; c++) {
+			links[0].a = borderStrips[c].pieces.front();
+			links[0].b = borderStrips[r].pieces.front();
+			links[0].k = links[0].a->right();
+			links[0].l = links[0].b->left();
+			if(EdgesCompatible(*links[0].a, links[0].k, *links[0].b, links[0].l) && CompareEdgesByShape(links) < 4.5)
+				assignMatrix[r*n+c] = CompareEdgesByColor(links);
+			else
+				assignMatrix[r*n+c] = 100000;
+		}
+	}
 
+	/* Strips are chained Kruskal style. A strip is named after its rightmost
+	   piece, whose free right edge is its column, and its row is the one of its
+	   leftmost piece. The row most confident in its best column against its
+	   second best is merged first. Columns only ever close, so each row walks
+	   its columns from best to worst once, and merging strip j into i only
+	   rescores i and the rows that had j in their best two. */
+	std::vector<int> rowOrder(n*n);
+	std::vector<int> rowNext(n, 0);
+	for (int r=0; r<n; r++) {
+		int * order = &rowOrder[r*n];
+		for (int c=0; c<n; c++) order[c] = c;
+		const float * row = &assignMatrix[r*n];
+		std::stable_sort(order, order+n, [row] (int c1, int c2) { return row[c1] < row[c2]; });
+	}
+	std::vector<int> parent(n), leftEnd(n), best(n), second(n), stamp(n, 0);
+	for (int i=0; i<n; i++) parent[i] = leftEnd[i] = i;
+	std::vector<BorderMerge> merges;
+	auto Rescore = [&] (int i) {
+		int row = leftEnd[i];
+		const int * order = &rowOrder[row*n];
+		while (rowNext[row] < n && (parent[order[rowNext[row]]] != order[rowNext[row]] || order[rowNext[row]] == i))
+			rowNext[row]++;
+		best[i] = second[i] = -1;
+		for (int o=rowNext[row]; o<n && second[i] < 0; o++) {
+			int c = order[o];
+			if (parent[c] != c || c == i) continue;
+			if (best[i] < 0) best[i] = c; else second[i] = c;
 		}
-		for (int i = 0; i<assignMatrix.size(); ++i) {
-			bool found = false;
-			for (std::list<int>::iterator j = assignment.begin(); j != assignment.end(); ++j){
-					if (i == *j){
-						found = true;
-						break;
-					}
+		float min = best[i] >= 0 ? std::min(assignMatrix[row*n+best[i]], 1e5f) : 1e5f;
+		float second_min = second[i] >= 0 ? std::min(assignMatrix[row*n+second[i]], 1e5f) : 1e5f;
+		stamp[i]++;
+		BorderMerge merge = {1-min/second_min, i, stamp[i]};
+		if (merge.confidence > 0) {
+			merges.push_back(merge);
+			std::push_heap(merges.begin(), merges.end());
+		}
+	};
+	for (int i=0; i<n; i++)
+		Rescore(i);
+
+	/* The ring search has to finish within m_BorderSearchNodes to be sure of its
+	   best ring. When it runs out the strips are merged down to half as many and
+	   searched again, unless no confident merge is left. */
+	int nStrips = n;
+	bool stalled = false;
+	std::vector<BorderStrip> strips;
+	BorderStripSearch search;
+	for (int target=m_MaxBorderStrips; ; target=max(nStrips/2, 1)) {
+		for (; nStrips>target && !stalled; nStrips--) {
+			while (!merges.empty() && merges.front().stamp != stamp[merges.front().strip]) {
+				std::pop_heap(merges.begin(), merges.end());
+				merges.pop_back();
 			}
-			if(!found){
-				int idxR = assignment.front();
-				int idxL = assignment.back();
-				if(assignMatrix[idxL][i] < assignMatrix[i][idxR])
-					assignment.push_back(i);
-				else{
-					assignment.push_front(i);
-					startidx++;
-				}
+			if (merges.empty()) {
+				stalled = true;
 				break;
 			}
+			int i = merges.front().strip, j = best[i];
+			std::pop_heap(merges.begin(), merges.end());
+			merges.pop_back();
+
+			borderStrips[i].addToLeft(borderStrips[j]);
+			parent[j] = i;
+			leftEnd[i] = leftEnd[j];
+			stamp[j]++;
+			for (int s=0; s<n; s++)
+				if (parent[s] == s && (s == i || best[s] == j || second[s] == j))
+					Rescore(s);
 		}
-		*/
-		//minimum found, combine strips
-		
-	    if(row_confident==0 ){//|| row_confident < rc_old/2) {
-			for (int i=0; i<borderStrips.size(); i++) {
-				float offset=i*1;
-				int count=0;
-				for (std::list<PuzzlePiece*>::iterator it = borderStrips[i].pieces.begin(); it != borderStrips[i].pieces.end(); ++it){ 
-					(*it)->transform(0, 3) += offset;
-					(*it)->transform(1, 3) +=1*count;count++;
-					m_AddedPuzzlePieces.push_back((*it));
-					m_nPiecesAdded++;
-				}
-			}
-			return;
+		strips.clear();
+		for (int i=0; i<n; i++)
+			if (parent[i] == i)
+				strips.push_back(borderStrips[i]);
+		if (SearchBorderRing(strips, search) || stalled || nStrips == 1)
 			break;
-		}
-		borderStrips[min_i].addToLeft(borderStrips[min_j]);
-		std::vector<BorderStrip>::iterator b_it = borderStrips.begin();
-		std::advance(b_it, min_j);
-		borderStrips.erase(b_it);
-		//update assignMatrix
-		assignMatrix[min_i] = assignMatrix[min_j];
-		std::vector<std::vector<float>>::iterator it = assignMatrix.begin();
-		std::advance(it, min_j);
-		assignMatrix.erase(it);
-		for(int i=0; i<assignMatrix.size() ; ++i){
-			std::vector<float>::iterator row_it = assignMatrix[i].begin();
-			std::advance(row_it, min_j);
-			assignMatrix[i].erase(row_it);
-		}
-		rc_old = row_confident;
-	}
-	//combine strips
-	/*for (int i=0; i<borderStrips.size(); i++) {
-				float offset=i*1;
-				int count=0;
-				for (std::list<PuzzlePiece*>::iterator it = borderStrips[i].pieces.begin(); it != borderStrips[i].pieces.end(); ++it){ 
-					(*it)->transform(0, 3) += offset;
-					(*it)->transform(1, 3) +=1*count;count++;
-					m_AddedPuzzlePieces.push_back((*it));
-					m_nPiecesAdded++;
-				}
-			}
-			return;*/
-	float globalMin = FLT_MAX;
-	borderStrips[0].isAdded = true;
-	std::list<int> recursiveBorder;
-	std::vector<std::list<int>> optBorder;
-	recursiveBorder.push_back(0);
-	borderStripSearch(globalMin, 0, borderStrips, recursiveBorder, optBorder, borderStrips.size()-1);
-	
-	float minShapeMatch = FLT_MAX;
-	int minBorderIdx = 0;
-	for (int i=0; i<optBorder.size(); i++) {
-		std::list<int>::iterator it = optBorder[i].begin();
-		std::list<PuzzlePiece*> test_border = borderStrips[*it].pieces;
-		for(++it; it!=optBorder[i].end(); ++it){
-			test_border.insert(test_border.end(), borderStrips[*it].pieces.begin(), borderStrips[*it].pieces.end());
-		}
-		float shapeMatch=0.f;
-		for(std::list<PuzzlePiece*>::iterator it_p = test_border.begin(); it_p!=test_border.end(); ++it_p){
-			std::list<PuzzlePiece*>::iterator it_left = it_p;
-			++it_left;
-			if(it_left == test_border.end())
-				it_left = test_border.begin();
-			int leftIdx = (*it_p)->left();
-			int rightIdx = (*it_left)->right();
-			std::vector<EdgeLinkInfo> test_links; test_links.resize(1);
-			test_links[0].a = *it_left;
-			test_links[0].b = *it_p;
-			test_links[0].k = rightIdx;
-			test_links[0].l = leftIdx;
-			shapeMatch += CompareEdgesByShape(test_links);
-		}
-		if(shapeMatch < minShapeMatch){
-			minShapeMatch = shapeMatch;
-			minBorderIdx = i;
-		}
 	}
-	
-	
-	std::list<int>::iterator it = optBorder[minBorderIdx].begin();
-	std::list<PuzzlePiece*> border = borderStrips[*it].pieces;
-	for(++it; it!=optBorder[minBorderIdx].end(); ++it){
-			border.insert(border.end(), borderStrips[*it].pieces.begin(), borderStrips[*it].pieces.end());
+	if (search.best.empty()) {
+		// No order of the strips closes into a rectangle, show them as they are
+		DebugBreak();
+		LayOutBorderStrips(strips);
+		return;
 	}
+	std::sort_heap(search.best.begin(), search.best.end());
+
+	std::vector<int>& ring = search.best[0].strips;
+	std::list<PuzzlePiece*> border = strips[ring[0]].pieces;
+	for (int i=1; i<ring.size(); i++)
+		border.insert(border.end(), strips[ring[i]].pieces.begin(), strips[ring[i]].pieces.end());
 	std::list<PuzzlePiece*>::iterator it_left;
 	std::list<PuzzlePiece*>::iterator it_right;
 
@@ -1533,17 +1731,17 @@ void JPuzzle::AssemblyBorderMST()
 		m_AddedPuzzlePieces[m_nPiecesAdded-1]->edgeCovered[lastEdgeIndex] = 1;*/
 }
 
-void JPuzzle::borderSearch(float& globalMin, float recursiveMin, std::vector<PuzzlePiece*>& pool, std::list<int>& border, std::list<int>& optBorder, const std::vector<std::vector<float> >& assignMatrix, int length) {
+void JPuzzle::borderSearch(float& globalMin, float recursiveMin, const std::vector<PuzzlePiece*>& pool, std::vector<char>& used, std::list<int>& border, std::list<int>& optBorder, const std::vector<std::vector<float> >& assignMatrix, int length) {
 		int idxL = border.back();
-		std::vector<float> row = assignMatrix[idxL];
+		const std::vector<float> & row = assignMatrix[idxL];
 		if (length==1){
 			//find a minimum corner
 			float min_corner = FLT_MAX;
 			int min_idx = -1;
 			for (int i = 0; i<pool.size(); ++i) {
-				if(pool[i]->isAdded==1)
+				if(used[i])
 					continue;
-				if(pool[i]->borders().size()==2){
+				if(pool[i]->nBorders()==2){
 					if (row[i] < min_corner){
 						min_corner = row[i];
 						min_idx = i;
@@ -1573,7 +1771,7 @@ void JPuzzle::borderSearch(float& globalMin, float recursiveMin, std::vector<Puz
 		for (int i = 0; i<row.size(); ++i) {
 			if (idxL == i)
 				continue;
-			if(pool[i]->isAdded || pool[i]->borders().size()==2)
+			if(used[i] || pool[i]->nBorders()==2)
 				continue;
 			if (row[i] < min){
 				second_min = min;
@@ -1586,34 +1784,31 @@ void JPuzzle::borderSearch(float& globalMin, float recursiveMin, std::vector<Puz
 				secondidx = i;
 			}
 		}
+		//no side piece left, the dimension does not fit
+		if(minidx == -1)
+			return;
 		//recursive call update min if necessary
-		pool[minidx]->isAdded = 1;
+		used[minidx] = 1;
 		border.push_back(minidx);
-		borderSearch(globalMin, recursiveMin + min, pool, border, optBorder, assignMatrix, length-1);
-		pool[minidx]->isAdded = 0;
+		borderSearch(globalMin, recursiveMin + min, pool, used, border, optBorder, assignMatrix, length-1);
+		used[minidx] = 0;
 		border.pop_back();
 		
 		//find a second minimum border piece
 		if(secondidx != -1){
-			pool[secondidx]->isAdded = 1;
+			used[secondidx] = 1;
 			border.push_back(secondidx);
 			//recursive call
-			borderSearch(globalMin, recursiveMin + second_min, pool, border, optBorder, assignMatrix, length-1);
-			pool[secondidx]->isAdded = 0;
+			borderSearch(globalMin, recursiveMin + second_min, pool, used, border, optBorder, assignMatrix, length-1);
+			used[secondidx] = 0;
 			border.pop_back();
 		}
 
 	};
 
-void JPuzzle::AssemblyBorderWithDimension(int w, int h)
+void JPuzzle::BuildBorderMatrix(std::vector<PuzzlePiece*>& borderPieces, std::vector<std::vector<float> >& assignMatrix)
 {
-	
 		std::vector<EdgeLinkInfo> links; links.resize(1);
-		std::vector<std::vector<float> > assignMatrix;
-		std::vector<PuzzlePiece*> borderPieces;
-		//MatrixXf mat;
-
-		int startidx = 0;
 		borderPieces.push_back(m_AddedPuzzlePieces[0]);
 
 		for (std::vector<PuzzlePiece*>::iterator it = m_NotAddedPuzzlePieces.begin(); it != m_NotAddedPuzzlePieces.end(); ++it) {
@@ -1632,7 +1827,7 @@ void JPuzzle::AssemblyBorderWithDimension(int w, int h)
 				links[0].b = *it_r;
 				links[0].k = rightIdx;
 				links[0].l = leftIdx;
-				if(CompareEdgesByShape(links) < 4)
+				if(EdgesCompatible(*links[0].a, links[0].k, *links[0].b, links[0].l) && CompareEdgesByShape(links) < 4)
 					row.push_back(CompareEdgesByColor(links));
 				else
 					row.push_back(100000);
@@ -1640,12 +1835,27 @@ void JPuzzle::AssemblyBorderWithDimension(int w, int h)
 			}
 			assignMatrix.push_back(row);
 		}
+}
+
+float JPuzzle::SolveBorderWithDimension(int w, int h, const std::vector<PuzzlePiece*>& borderPieces, const std::vector<std::vector<float> >& assignMatrix, std::list<int>& borders)
+{
+		/* Sides of w and h pieces corners included, walked from the first corner.
+		   Gives the cost of the ring or FLT_MAX when a side cannot end on a corner,
+		   pieces are left over or the ring does not lay out as a w x h frame. */
+		int startidx = 0;
+		while (startidx < borderPieces.size() && borderPieces[startidx]->nBorders() != 2)
+			startidx++;
+		if (startidx == borderPieces.size())
+			return FLT_MAX;
+		std::vector<char> used(borderPieces.size(), 0);
+		used[startidx] = 1;
 
 		//extend to left border of length w
 		std::list<int> border[4];
 		
 		std::list<int> optBorder[4];
 
+		float cost = 0;
 		for(int i=0; i<4; ++i) {
 			if(i==0)
 				border[i].push_back(startidx);
@@ -1653,19 +1863,137 @@ void JPuzzle::AssemblyBorderWithDimension(int w, int h)
 				border[i].push_back(optBorder[i-1].back());
 			float globalMin = FLT_MAX;
 			if(i%2==0)
-				borderSearch(globalMin, 0, borderPieces, border[i], optBorder[i], assignMatrix, w-1);
+				borderSearch(globalMin, 0, borderPieces, used, border[i], optBorder[i], assignMatrix, w-1);
 			else
-				borderSearch(globalMin, 0, borderPieces, border[i], optBorder[i], assignMatrix, h-1);
+				borderSearch(globalMin, 0, borderPieces, used, border[i], optBorder[i], assignMatrix, h-1);
+			if(optBorder[i].size() < 2 || (i < 3 && borderPieces[optBorder[i].back()]->nBorders() != 2))
+				return FLT_MAX;
 			for(std::list<int>::iterator it=optBorder[i].begin(); it != optBorder[i].end(); ++it)
-				borderPieces[*it]->isAdded = 1;
+				used[*it] = 1;
+			cost += globalMin;
 		}
-		std::list<int> borders;
+		borders.clear();
 		borders.insert(borders.begin(), optBorder[0].begin(), optBorder[0].end());
 		for(int i=1; i<4; ++i){
 			std::list<int>::iterator it = optBorder[i].begin();
 			++it;
 			borders.insert(borders.end(),it, optBorder[i].end());
 		}
+		if(borders.size() != borderPieces.size() || !BorderRingFits(w, h, borderPieces, borders))
+			return FLT_MAX;
+		return cost + assignMatrix[borders.back()][startidx];
+}
+
+bool JPuzzle::BorderRingFits(int w, int h, const std::vector<PuzzlePiece*>& borderPieces, const std::list<int>& borders)
+{
+	/* Lays the ring out on the lattice the way BuildGrid will, the left edge of
+	   each piece against the right edge of the next. It fits when it closes on
+	   its first piece, takes every cell around a w x h box once and turns all
+	   border edges out of the box. */
+	std::vector<int> ring(borders.begin(), borders.end());
+	int n = ring.size();
+	std::vector<int> x(n+1, 0), y(n+1, 0), rotation(n+1, 0);
+	int xMin=0, xMax=0, yMin=0, yMax=0;
+	for (int i=0; i<n; i++) {
+		PuzzlePiece & p = *borderPieces[ring[i]];
+		PuzzlePiece & next = *borderPieces[ring[(i+1)%n]];
+		int d = (p.left()+rotation[i])%4;
+		x[i+1] = x[i]+g_GridStepX[d];
+		y[i+1] = y[i]+g_GridStepY[d];
+		rotation[i+1] = (d+2-next.right()+4)%4;
+		xMin = min(xMin, x[i+1]); xMax = max(xMax, x[i+1]);
+		yMin = min(yMin, y[i+1]); yMax = max(yMax, y[i+1]);
+	}
+	if (x[n] != 0 || y[n] != 0 || rotation[n] != 0)
+		return false;
+	int width = xMax-xMin+1, height = yMax-yMin+1;
+	if (!((width == w && height == h) || (width == h && height == w)) || n != 2*(width+height)-4)
+		return false;
+	std::vector<char> taken(width*height, 0);
+	for (int i=0; i<n; i++) {
+		char & cell = taken[(y[i]-yMin)*width + x[i]-xMin];
+		if (cell) return false;
+		cell = 1;
+		PuzzlePiece & p = *borderPieces[ring[i]];
+		for (int k=0; k<4; k++) {
+			if (!p.edgeIsBorder[k]) continue;
+			int d = (k+rotation[i])%4;
+			int nx = x[i]+g_GridStepX[d], ny = y[i]+g_GridStepY[d];
+			if (nx >= xMin && nx <= xMax && ny >= yMin && ny <= yMax)
+				return false;
+		}
+	}
+	return true;
+}
+
+void JPuzzle::AssemblyBorderWithDimension(int w, int h)
+{
+		std::vector<PuzzlePiece*> borderPieces;
+		std::vector<std::vector<float> > assignMatrix;
+		BuildBorderMatrix(borderPieces, assignMatrix);
+
+		std::list<int> borders;
+		if (SolveBorderWithDimension(w, h, borderPieces, assignMatrix, borders) == FLT_MAX) {
+			DebugBreak();
+			AssemblyBorderMST();
+			return;
+		}
+		PlaceBorderRing(borderPieces, borders);
+}
+
+void JPuzzle::AssemblyBorderFindDimension()
+{
+		/* A w x h puzzle has 2(w+h)-4 border pieces, and w*h pieces in all when
+		   none are missing. Every (w, h) that fits is solved, both ways round since
+		   the first corner may start a side of either length, and the cheapest
+		   ring that lays out as a frame is placed. Without one the strips decide. */
+		std::vector<PuzzlePiece*> borderPieces;
+		std::vector<std::vector<float> > assignMatrix;
+		BuildBorderMatrix(borderPieces, assignMatrix);
+
+		int nBorderPieces = borderPieces.size(), nCorners = 0;
+		for (int i=0; i<nBorderPieces; i++)
+			nCorners += borderPieces[i]->nBorders() == 2;
+		int sides = nBorderPieces/2+2;
+		std::vector<std::pair<int, int> > candidates;
+		if (nCorners == 4 && nBorderPieces%2 == 0) {
+			for (int w=2; w<=sides-2; w++)
+				if (w*(sides-w) == m_nPuzzlePieces)
+					candidates.push_back(std::make_pair(w, sides-w));
+			if (candidates.empty()) {
+				for (int w=2; w<=sides-2; w++)
+					candidates.push_back(std::make_pair(w, sides-w));
+			}
+		}
+
+		std::vector<std::list<int> > rings(candidates.size());
+		std::vector<float> costs(candidates.size(), FLT_MAX);
+		std::atomic<int> nextCandidate(0);
+		auto Worker = [&] () {
+			for (int c; (c = nextCandidate++) < (int)candidates.size(); )
+				costs[c] = SolveBorderWithDimension(candidates[c].first, candidates[c].second, borderPieces, assignMatrix, rings[c]);
+		};
+		int nThreads = max(1, min((int)std::thread::hardware_concurrency(), (int)candidates.size()));
+		std::vector<std::thread> threads;
+		for (int t=1; t<nThreads; t++) threads.push_back(std::thread(Worker));
+		Worker();
+		for (int t=0; t<threads.size(); t++) threads[t].join();
+
+		int best = -1;
+		for (int c=0; c<candidates.size(); c++)
+			if (costs[c] < FLT_MAX && (best < 0 || costs[c] < costs[best]))
+				best = c;
+		if (best < 0) {
+			AssemblyBorderMST();
+			return;
+		}
+		PlaceBorderRing(borderPieces, rings[best]);
+}
+
+void JPuzzle::PlaceBorderRing(std::vector<PuzzlePiece*>& borderPieces, std::list<int>& borders)
+{
+		// The walk starts from the piece that is already placed, borderPieces[0]
+		borders.splice(borders.end(), borders, borders.begin(), std::find(borders.begin(), borders.end(), 0));
 		std::list<int>::iterator it = borders.begin();
 		//std::advance(it, startidx);
 		std::list<int>::iterator it_left = it;
@@ -1776,185 +2104,773 @@ void JPuzzle::AssemblyBorderWithDimension(int w, int h)
 		m_AddedPuzzlePieces[m_nPiecesAdded-1]->edgeCovered[lastEdgeIndex] = 1;*/
 }
 
-int CompareEdgeMeasures(const void * a, const void * b) 
+void JPuzzle::FindNeighbors(PuzzlePiece & a, PuzzlePiece & b, int k, int l, std::vector<EdgeLinkInfo> & links)
 {
-	if (*(float*)a <  *(float*)b) return (int)-1;
-	if (*(float*)a == *(float*)b) return (int)0;
-	if (*(float*)a >  *(float*)b) return (int)1;
+	/* b goes in the cell that edge k of a faces, turned so its edge l faces back */
+	if (a.gridRotation < 0) {
+		EdgeLinkInfo eInfo = {0, &a, &b, k, l};
+		links.push_back(eInfo);
+		return;
+	}
+	int d = (k+a.gridRotation)%4;
+	int cell = GridCellIndex(a.gridX+g_GridStepX[d], a.gridY+g_GridStepY[d]);
+	GridSlotLinks(cell, b, (d+2-l+4)%4, links);
 }
 
-void JPuzzle::FindNeighbors(PuzzlePiece & a, PuzzlePiece & b, int k, int l, std::vector<EdgeLinkInfo> & links)
+bool JPuzzle::GridSlotLinks(const GridCell * grid, int cell, PuzzlePiece & b, int rotation, std::vector<EdgeLinkInfo> & links)
 {
-	auto FindAdjEdgePiece = [] (PuzzlePiece * center, int adjEdgeIndex, PuzzlePiece *& next, int & nextEdgeIndex, int dir) {
-		next = center->adjPieces[adjEdgeIndex];
-		if (next == 0) return false;
-		nextEdgeIndex = 0;
-		while (next->adjPieces[nextEdgeIndex] != center) nextEdgeIndex++;
-		if (dir>0) nextEdgeIndex = nextEdgeIndex-1 < 0 ? 3 : nextEdgeIndex-1;
-		else nextEdgeIndex = (nextEdgeIndex+1)%4;
-		return next->edgeCovered[nextEdgeIndex];
-	};
+	/* One link per placed neighbour of the cell. False when the cell is taken,
+	   off the grid, or faces a border edge and so lies outside the puzzle. */
+	if (cell < 0 || grid[cell].piece >= 0) return false;
+	int x = cell%m_GridWidth + m_GridX0, y = cell/m_GridWidth + m_GridY0;
+	for (int d=0; d<4; d++) {
+		int n = GridCellIndex(x+g_GridStepX[d], y+g_GridStepY[d]);
+		if (n < 0 || grid[n].piece < 0) continue;
+		PuzzlePiece & neighbor = m_PuzzlePieces[grid[n].piece];
+		int k = (d+2-grid[n].rotation+4)%4;
+		if (neighbor.edgeIsBorder[k]) return false;
+		EdgeLinkInfo eInfo = {0, &neighbor, &b, k, (d-rotation+4)%4};
+		links.push_back(eInfo);
+	}
+	return true;
+}
 
-	auto FindAdjLink = [&FindAdjEdgePiece, &b, &links] (PuzzlePiece * center, int centerEdgeIndex, int & notAddedEdgeIndex, PuzzlePiece *& next, int & nextEdgeIndex, int dir) {
-		PuzzlePiece * right = 0;
-		int rightEdgeIndex = 0;
-		int index = 0;
-		if (dir>0) index = centerEdgeIndex-1 < 0 ? 3 : centerEdgeIndex-1;
-		else index = (centerEdgeIndex+1)%4;
-		if (!FindAdjEdgePiece(center, index, right, rightEdgeIndex, dir)) return 0;
-		else {
-			if (right->edgeIsBorder[rightEdgeIndex]) return 0;
-			//int asdf=0;
-		//	FindAdjEdgePiece(center, centerEdgeIndex-1 < 0 ? 3 : centerEdgeIndex-1, right, rightEdgeIndex);
-			if (FindAdjEdgePiece(right, rightEdgeIndex, next, nextEdgeIndex, dir)) {
-				if (next->edgeIsBorder[nextEdgeIndex]) return 0;
-				DebugBreak();
-			} else {
-				EdgeLinkInfo eInfo;
-				eInfo.a = next;
-				eInfo.b = &b;
-				eInfo.k = nextEdgeIndex;
-				if (dir<0) notAddedEdgeIndex = notAddedEdgeIndex-1 < 0 ? 3 : notAddedEdgeIndex-1;
-				else notAddedEdgeIndex = (notAddedEdgeIndex+1)%4;
-				eInfo.l = notAddedEdgeIndex;
-				links.push_back(eInfo);
-				return 1;
-			}
+void JPuzzle::BuildGrid()
+{
+	/* Lay the placed pieces out by walking their links from the first one */
+	std::vector<PuzzlePiece*> queue;
+	queue.reserve(m_nPuzzlePieces);
+	for (int i=0; i<m_nPuzzlePieces; i++) m_PuzzlePieces[i].gridRotation = -1;
+	PuzzlePiece * root = m_AddedPuzzlePieces[0];
+	root->gridX = root->gridY = root->gridRotation = 0;
+	queue.push_back(root);
+	int xMin=0, xMax=0, yMin=0, yMax=0;
+	for (int q=0; q<queue.size(); q++) {
+		PuzzlePiece & p = *queue[q];
+		for (int k=0; k<4; k++) {
+			PuzzlePiece * next = p.adjPieces[k];
+			if (!next || !next->isAdded || next->gridRotation >= 0) continue;
+			int j = 0;
+			while (j<4 && next->adjPieces[j] != &p) j++;
+			if (j == 4) continue;
+			int d = (k+p.gridRotation)%4;
+			next->gridX = p.gridX+g_GridStepX[d];
+			next->gridY = p.gridY+g_GridStepY[d];
+			next->gridRotation = (d+2-j+4)%4;
+			xMin = min(xMin, next->gridX); xMax = max(xMax, next->gridX);
+			yMin = min(yMin, next->gridY); yMax = max(yMax, next->gridY);
+			queue.push_back(next);
 		}
-		return 0;
-	};
+	}
+
+	m_GridX0 = xMin-1;
+	m_GridY0 = yMin-1;
+	m_GridWidth = xMax-xMin+3;
+	m_GridHeight = yMax-yMin+3;
+	GridCell empty = {-1, 0};
+	m_Grid.assign(m_GridWidth*m_GridHeight, empty);
+	for (int q=0; q<queue.size(); q++) {
+		PuzzlePiece & p = *queue[q];
+		GridCell & c = m_Grid[GridCellIndex(p.gridX, p.gridY)];
+		if (c.piece >= 0) {
+			// Two pieces claim the cell, the links disagree; keep the first one
+			p.gridRotation = -1;
+			continue;
+		}
+		c.piece = p.index;
+		c.rotation = p.gridRotation;
+	}
+}
+
+void JPuzzle::ComparePieces()
+{
+	if (m_PairScores.empty())
+		BuildPairScores();
+	if (m_AssemblyMode == AssemblyRelaxation && m_MatchBeliefs.empty())
+		RelaxMatchBeliefs();
+	if (m_SlotVersion.empty())
+		BuildFrontier();
+
+	if (m_AssemblyMode == AssemblyBeam) {
+		if (!m_BeamDone)
+			BeamSearch();
+		// Past the end of the plan, when the beam ran out of moves, continue greedily
+		if (m_BeamNext < m_BeamPlan.size()) {
+			BeamMove & move = m_BeamPlan[m_BeamNext++];
+			PlacePiece(GridCellIndex(move.x, move.y), m_PuzzlePieces[move.b], move.rotation);
+			return;
+		}
+	}
 
-	PuzzlePiece * currentAdded = &a;
-	int currentAddedEdgeIndex = k;
-	int currentNonAddedEdgeIndex = l;
-	PuzzlePiece * next = 0;
-	int nextEdgeIndex = 0;
-	while (FindAdjLink(currentAdded, currentAddedEdgeIndex, currentNonAddedEdgeIndex, next, nextEdgeIndex, 1) && next != &a) {
-		currentAdded = next;
-		currentAddedEdgeIndex = nextEdgeIndex;
+	/* The best live candidate: most placed neighbours, then the ones whose mean
+	   shape passed the gate by color, then the rest by shape */
+	while (!m_Frontier.empty()) {
+		SlotCandidate top = m_Frontier.front();
+		if (m_Grid[top.cell].piece >= 0 || top.version != m_SlotVersion[top.cell]) {
+			std::pop_heap(m_Frontier.begin(), m_Frontier.end());
+			m_Frontier.pop_back();
+			continue;
+		}
+		if (!m_PuzzlePieces[top.b].isAdded) break;
+		// Once a cell has lost all its kept candidates to other cells, fetch its next best
+		std::pop_heap(m_Frontier.begin(), m_Frontier.end());
+		m_Frontier.pop_back();
+		if (--m_SlotLive[top.cell] == 0) ScoreSlot(top.cell);
 	}
+	if (m_Frontier.empty()) 
+		DebugBreak();
+	SlotCandidate top = m_Frontier.front();
+	std::pop_heap(m_Frontier.begin(), m_Frontier.end());
+	m_Frontier.pop_back();
 
+	PlacePiece(top.cell, m_PuzzlePieces[top.b], top.rotation);
+}
 
+void JPuzzle::PlacePiece(int cell, PuzzlePiece & b, int rotation)
+{
+	std::vector<EdgeLinkInfo> & links = m_StepLinks;
+	links.resize(0);
+	GridSlotLinks(cell, b, rotation, links);
+	MovePiece(links[0]);
+	for (int i=0; i<links.size(); i++) {
+		links[i].a->adjPieces[links[i].k] = links[i].b;
+		links[i].a->edgeCovered[links[i].k] = 1;
+		links[i].b->adjPieces[links[i].l] = links[i].a;
+		links[i].b->edgeCovered[links[i].l] = 1;
+	}
+	b.isAdded = 1;
+
+	b.gridX = cell%m_GridWidth + m_GridX0;
+	b.gridY = cell/m_GridWidth + m_GridY0;
+	b.gridRotation = rotation;
+	m_Grid[cell].piece = b.index;
+	m_Grid[cell].rotation = rotation;
+	CloseSlot(cell);
+	if (b.gridX == m_GridX0 || b.gridY == m_GridY0 || b.gridX == m_GridX0+m_GridWidth-1 || b.gridY == m_GridY0+m_GridHeight-1) {
+		// The piece took a margin cell, lay the grid out again with room around it
+		m_SlotVersion.clear();
+		BuildFrontier();
+		return;
+	}
 
-	if (links.size() < 4) {
-		currentAdded = &a;
-		currentAddedEdgeIndex = k;
-		currentNonAddedEdgeIndex = l;
+	/* The links of a cell are the pieces on its four sides in m_Grid, so the
+	   empty cells next to the new piece are the only ones whose links changed;
+	   diagonal cells keep theirs. Each of them is scored again under a new
+	   version, including a cell already open through another neighbour that b
+	   now faces with a border edge, whose old candidates no longer fit. */
+	for (int d=0; d<4; d++) {
+		int n = GridCellIndex(b.gridX+g_GridStepX[d], b.gridY+g_GridStepY[d]);
+		if (n < 0 || m_Grid[n].piece >= 0) continue;
+		if (!b.edgeIsBorder[(d-b.gridRotation+4)%4]) OpenSlot(n);
+		else if (m_OpenSlotIndex[n] < 0) continue;
+		ScoreSlot(n);
+	}
+}
 
-		while (FindAdjLink(currentAdded, currentAddedEdgeIndex, currentNonAddedEdgeIndex, next, nextEdgeIndex, -1) && next != &a) {
-			currentAdded = next;
-			currentAddedEdgeIndex = nextEdgeIndex;
+void JPuzzle::BuildFrontier()
+{
+	/* Every buffer of the interior loop is sized here, once. A cell keeps at most
+	   m_SlotCandidates entries of its current version, so with twice that room
+	   for every cell a compaction always frees space before the heap would grow. */
+	BuildGrid();
+	int nCells = m_Grid.size();
+	m_SlotVersion.assign(nCells, 0);
+	m_SlotLive.assign(nCells, 0);
+	m_OpenSlotIndex.assign(nCells, -1);
+	m_OpenSlots.clear();
+	m_OpenSlots.reserve(nCells);
+	m_Frontier.clear();
+	m_Frontier.reserve(2*nCells*m_SlotCandidates);
+	m_SlotEdges.reserve(4*m_nPuzzlePieces);
+	m_SlotScored.reserve(4*m_nPuzzlePieces);
+	m_SlotLinks.reserve(4);
+	m_StepLinks.reserve(4);
+	for (int cell=0; cell<nCells; cell++) {
+		if (m_Grid[cell].piece < 0) continue;
+		PuzzlePiece & p = m_PuzzlePieces[m_Grid[cell].piece];
+		for (int d=0; d<4; d++) {
+			int k = (d-p.gridRotation+4)%4;
+			if (p.edgeCovered[k] || p.edgeIsBorder[k]) continue;
+			int n = GridCellIndex(p.gridX+g_GridStepX[d], p.gridY+g_GridStepY[d]);
+			if (n >= 0 && m_Grid[n].piece < 0) OpenSlot(n);
 		}
 	}
+	for (int i=0; i<m_OpenSlots.size(); i++)
+		ScoreSlot(m_OpenSlots[i]);
+}
 
+void JPuzzle::OpenSlot(int cell)
+{
+	if (m_OpenSlotIndex[cell] >= 0) return;
+	m_OpenSlotIndex[cell] = m_OpenSlots.size();
+	m_OpenSlots.push_back(cell);
+}
 
-	if (links.size() < 4) {
-		// Center edge
-		EdgeLinkInfo eInfo;
-		eInfo.a = &a;
-		eInfo.b = &b;
-		eInfo.k = k;
-		eInfo.l = l;
-		links.push_back(eInfo);
+void JPuzzle::CloseSlot(int cell)
+{
+	int i = m_OpenSlotIndex[cell];
+	if (i < 0) return;
+	m_OpenSlots[i] = m_OpenSlots.back();
+	m_OpenSlotIndex[m_OpenSlots[i]] = i;
+	m_OpenSlots.pop_back();
+	m_OpenSlotIndex[cell] = -1;
+}
+
+void JPuzzle::PushSlotCandidate(const SlotCandidate & entry)
+{
+	if (m_Frontier.size() == m_Frontier.capacity()) {
+		// Drop entries of filled or rescored cells instead of growing
+		int kept = 0;
+		for (int i=0; i<m_Frontier.size(); i++) {
+			const SlotCandidate & old = m_Frontier[i];
+			if (m_Grid[old.cell].piece < 0 && old.version == m_SlotVersion[old.cell])
+				m_Frontier[kept++] = old;
+		}
+		m_Frontier.resize(kept);
+		std::make_heap(m_Frontier.begin(), m_Frontier.end());
 	}
+	m_Frontier.push_back(entry);
+	std::push_heap(m_Frontier.begin(), m_Frontier.end());
 }
 
-void JPuzzle::ComparePieces()
+void JPuzzle::ScoreSlot(int cell)
 {
-	/* Compute the measures */
-	int largestLink=0;
-	std::vector<EdgeLinkInfo> links;
-	int nMeasures = 0;
-	EdgeLinkInfo * measures = new EdgeLinkInfo[m_AddedPuzzlePieces.size()*m_NotAddedPuzzlePieces.size()*4*4]; 
-	for (int i=0; i<m_AddedPuzzlePieces.size(); i++) {
-		for (int j=0; j<m_NotAddedPuzzlePieces.size(); j++) {
-			if (m_NotAddedPuzzlePieces[j]->isAdded) continue;
-			for (int k=0; k<4; k++) {
-				for (int l=0; l<4; l++) {
-					if (k==3 && l==1)
-						int aa=0;
-					if (!m_AddedPuzzlePieces[i]->edgeCovered[k] && !m_NotAddedPuzzlePieces[j]->edgeCovered[l]) {
-						if (m_AddedPuzzlePieces[i]->index == 3 && m_NotAddedPuzzlePieces[j]->index == 4) 
-							int asdf=0;
-						FindNeighbors(*m_AddedPuzzlePieces[i], *m_NotAddedPuzzlePieces[j], k, l, links);
-						
-						/*if (links.size() == 4) {
-							int asdf=0;
-							links.resize(0);
-							FindNeighbors(*m_AddedPuzzlePieces[i], *m_NotAddedPuzzlePieces[j], k, l, links);
-						}*/
-						float val = CompareEdgesByShape(links);
-						if (val < 10000 && links.size() >= largestLink) {
-							if (links.size() > largestLink) { 
-								largestLink = links.size();
-								nMeasures = 0; //reset
-							}
-							
-							measures[nMeasures].measure = val/links.size();
-							measures[nMeasures].a = m_AddedPuzzlePieces[i];
-							measures[nMeasures].b = m_NotAddedPuzzlePieces[j];
-							//measures[nMeasures].j = j;
-							measures[nMeasures].k = k;
-							measures[nMeasures++].l = l;
-						}
-						links.resize(0);
+	/* Replaces the candidates of an empty cell. Older entries keep the previous
+	   version and are skipped. */
+	unsigned int version = ++m_SlotVersion[cell];
+	std::vector<int> & candidates = m_SlotEdges;
+	std::vector<EdgeLinkInfo> & links = m_SlotLinks;
+	std::vector<SlotCandidate> & scored = m_SlotScored;
+	scored.resize(0);
+	m_SlotLive[cell] = 0;
+
+	// Candidates come from the edge of the first placed neighbour facing the cell
+	int x = cell%m_GridWidth + m_GridX0, y = cell/m_GridWidth + m_GridY0;
+	int d = 0, n = -1;
+	for (; d<4; d++) {
+		n = GridCellIndex(x+g_GridStepX[d], y+g_GridStepY[d]);
+		if (n >= 0 && m_Grid[n].piece >= 0) break;
+	}
+	if (d == 4) return;
+	PuzzlePiece & a = m_PuzzlePieces[m_Grid[n].piece];
+	int k = (d+2-m_Grid[n].rotation+4)%4;
+
+	// Only edges of a compatible length can be placed against k
+	CompatibleEdges(a, k, candidates);
+	for (int c=0; c<candidates.size(); c++) {
+		PuzzlePiece * b = &m_PuzzlePieces[candidates[c]/4];
+		int l = candidates[c]%4;
+		if (b->isAdded) continue;
+		int rotation = (d-l+4)%4;
+		links.resize(0);
+		if (!GridSlotLinks(cell, *b, rotation, links)) return;
+		float val = PairShape(links);
+		if (val < 10000) {
+			SlotCandidate entry;
+			entry.cell = cell;
+			entry.b = b->index;
+			entry.rotation = rotation;
+			entry.nLinks = links.size();
+			entry.measure = val/links.size();
+			entry.gated = entry.measure < m_SlotShapeGate;
+			if (entry.gated) entry.measure = m_AssemblyMode == AssemblyRelaxation ? BeliefCost(links) : PairColor(links);
+			entry.version = version;
+			scored.push_back(entry);
+		}
+	}
+
+	/* All entries of a cell have the same nLinks, so the entry after the kept
+	   ones can only win once every kept one has been dropped, and then the cell
+	   is scored again. Keeping the best K loses nothing. */
+	if (scored.size() > m_SlotCandidates) {
+		std::nth_element(scored.begin(), scored.begin()+m_SlotCandidates, scored.end(),
+			[] (const SlotCandidate & x, const SlotCandidate & y) { return y < x; });
+		scored.resize(m_SlotCandidates);
+	}
+	m_SlotLive[cell] = scored.size();
+	for (int i=0; i<scored.size(); i++)
+		PushSlotCandidate(scored[i]);
+}
+
+void JPuzzle::BeamSearch()
+{
+	/* Every step expands each state by its best moves, in parallel, and keeps the
+	   m_BeamWidth children whose seams have the lowest mean color distance */
+	m_BeamDone = 1;
+	m_BeamPlan.clear();
+	m_BeamNext = 0;
+
+	std::vector<BeamState> beam(1);
+	beam[0].grid = m_Grid;
+	beam[0].placed.resize(m_nPuzzlePieces);
+	for (int i=0; i<m_nPuzzlePieces; i++) beam[0].placed[i] = m_PuzzlePieces[i].isAdded;
+	beam[0].cost = 0;
+	beam[0].nSeams = 0;
+	beam[0].hash = 0;
+	int nFree = std::count(beam[0].placed.begin(), beam[0].placed.end(), 0);
+
+	std::vector<std::vector<BeamChild> > children;
+	std::vector<BeamChild> merged;
+	std::vector<BeamState> next;
+	m_BeamScratch.resize(max(1, (int)std::thread::hardware_concurrency()));
+	for (int step=0; step<nFree; step++) {
+		children.resize(beam.size());
+		std::atomic<int> nextState(0);
+		auto Worker = [&] (int t) {
+			for (int i; (i = nextState++) < (int)beam.size(); )
+				ExpandBeamState(beam[i], i, m_BeamScratch[t], children[i]);
+		};
+		int nThreads = min((int)m_BeamScratch.size(), (int)beam.size());
+		std::vector<std::thread> threads;
+		for (int t=1; t<nThreads; t++) threads.push_back(std::thread(Worker, t));
+		Worker(0);
+		for (int t=0; t<threads.size(); t++) threads[t].join();
+
+		merged.clear();
+		for (int i=0; i<children.size(); i++)
+			merged.insert(merged.end(), children[i].begin(), children[i].end());
+		if (merged.empty()) break;
+		std::stable_sort(merged.begin(), merged.end(),
+			[] (const BeamChild & x, const BeamChild & y) { return x.Rank() < y.Rank(); });
+
+		next.clear();
+		for (int i=0; i<merged.size() && next.size()<m_BeamWidth; i++) {
+			const BeamChild & child = merged[i];
+			bool seen = false;
+			for (int j=0; j<next.size() && !seen; j++) seen = next[j].hash == child.hash;
+			if (seen) continue;
+			next.push_back(beam[child.parent]);
+			BeamState & state = next.back();
+			int cell = GridCellIndex(child.move.x, child.move.y);
+			state.grid[cell].piece = child.move.b;
+			state.grid[cell].rotation = child.move.rotation;
+			state.placed[child.move.b] = 1;
+			state.moves.push_back(child.move);
+			state.cost = child.cost;
+			state.nSeams = child.nSeams;
+			state.hash = child.hash;
+		}
+		beam.swap(next);
+	}
+	m_BeamPlan = beam[0].moves;
+}
+
+void JPuzzle::ExpandBeamState(const BeamState & state, int parent, BeamScratch & scratch, std::vector<BeamChild> & children)
+{
+	/* The same rule as the greedy step, applied to this state: only the empty
+	   cells with the most placed neighbours, and there the moves that pass the
+	   shape gate when there are any. The best m_BeamWidth of them are kept. */
+	std::vector<int> & edges = scratch.edges;
+	std::vector<EdgeLinkInfo> & links = scratch.links;
+	std::vector<float> & shapes = scratch.shapes;
+	children.clear();
+	shapes.clear();
+	int bestLinks = 0;
+	bool gatedOnly = false;
+	for (int cell=0; cell<state.grid.size(); cell++) {
+		if (state.grid[cell].piece >= 0) continue;
+		int x = cell%m_GridWidth + m_GridX0, y = cell/m_GridWidth + m_GridY0;
+		int d = 0, n = -1, nNeighbors = 0;
+		for (int e=0; e<4; e++) {
+			int m = GridCellIndex(x+g_GridStepX[e], y+g_GridStepY[e]);
+			if (m < 0 || state.grid[m].piece < 0) continue;
+			if (nNeighbors++ == 0) { d = e; n = m; }
+		}
+		if (nNeighbors == 0 || nNeighbors < bestLinks) continue;
+
+		PuzzlePiece & a = m_PuzzlePieces[state.grid[n].piece];
+		int k = (d+2-state.grid[n].rotation+4)%4;
+		CompatibleEdges(a, k, edges);
+		for (int c=0; c<edges.size(); c++) {
+			PuzzlePiece & b = m_PuzzlePieces[edges[c]/4];
+			int l = edges[c]%4;
+			if (state.placed[b.index]) continue;
+			int rotation = (d-l+4)%4;
+			links.resize(0);
+			if (!GridSlotLinks(state.grid.data(), cell, b, rotation, links)) break;
+			float val = PairShape(links);
+			if (val >= 10000) continue;
+			float shape = val/links.size();
+			bool gated = shape < m_SlotShapeGate;
+			if (links.size() > bestLinks || (links.size() == bestLinks && gated && !gatedOnly)) {
+				children.clear();
+				shapes.clear();
+				bestLinks = links.size();
+				gatedOnly = gated;
+			}
+			if (links.size() < bestLinks || (gatedOnly && !gated)) continue;
+
+			BeamChild child;
+			child.parent = parent;
+			child.move.x = x;
+			child.move.y = y;
+			child.move.b = b.index;
+			child.move.rotation = rotation;
+			child.cost = gated ? PairColorShared(links) : 0;
+			child.nSeams = links.size();
+			unsigned long long key = ((unsigned long long)cell*m_nPuzzlePieces + b.index)*4 + rotation + 1;
+			key *= 0x9E3779B97F4A7C15ull;
+			child.hash = state.hash ^ (key ^ (key >> 29));
+			children.push_back(child);
+			shapes.push_back(shape);
+		}
+	}
+
+	// Without gated moves the shape picks the candidates, their colors rank them
+	if (!gatedOnly && children.size() > m_BeamWidth) {
+		std::vector<int> & order = scratch.order;
+		std::vector<BeamChild> & kept = scratch.kept;
+		order.resize(children.size());
+		for (int i=0; i<order.size(); i++) order[i] = i;
+		std::nth_element(order.begin(), order.begin()+m_BeamWidth, order.end(),
+			[&shapes] (int x, int y) { return shapes[x] < shapes[y]; });
+		kept.clear();
+		for (int i=0; i<m_BeamWidth; i++) kept.push_back(children[order[i]]);
+		children.assign(kept.begin(), kept.end());
+	}
+	for (int i=0; i<children.size(); i++) {
+		BeamChild & child = children[i];
+		if (!gatedOnly) {
+			links.resize(0);
+			GridSlotLinks(state.grid.data(), GridCellIndex(child.move.x, child.move.y), m_PuzzlePieces[child.move.b], child.move.rotation, links);
+			child.cost = PairColorShared(links);
+		}
+		child.cost += state.cost;
+		child.nSeams += state.nSeams;
+	}
+	if (children.size() > m_BeamWidth) {
+		std::nth_element(children.begin(), children.begin()+m_BeamWidth, children.end(),
+			[] (const BeamChild & x, const BeamChild & y) { return x.cost < y.cost; });
+		children.resize(m_BeamWidth);
+	}
+}
+
+float JPuzzle::PairColorShared(std::vector<EdgeLinkInfo> & links)
+{
+	/* PairColor for worker threads, pairs missing from the table are computed
+	   but not stored */
+	float measure = 0;
+	for (int i=0; i<links.size(); i++) {
+		float color = GetPairScore(*links[i].a, links[i].k, *links[i].b, links[i].l).color;
+		if (color < 0)
+			color = EdgeColorDistance(*links[i].a, links[i].k, *links[i].b, links[i].l);
+		measure += color;
+	}
+	return measure;
+}
+
+void JPuzzle::RelaxMatchBeliefs()
+{
+	/* Start from the colors of the shape-compatible partners of each edge, then
+	   let every edge re-weigh its partners by their support, all edges at once
+	   from the previous iteration's beliefs */
+	int nEdges = 4*m_nPuzzlePieces;
+	MatchBeliefs none;
+	none.n = 0;
+	m_MatchBeliefs.assign(nEdges, none);
+	std::vector<int> edges;
+	std::vector<std::pair<float, int> > partners;
+	std::vector<EdgeLinkInfo> links(1);
+	std::vector<float> colors(nEdges*m_RelaxCandidates);
+	float bestSum = 0;
+	int nBest = 0;
+	for (int e=0; e<nEdges; e++) {
+		PuzzlePiece & a = m_PuzzlePieces[e/4];
+		CompatibleEdges(a, e%4, edges);
+		partners.clear();
+		for (int c=0; c<edges.size(); c++) {
+			PuzzlePiece & b = m_PuzzlePieces[edges[c]/4];
+			if (GetPairScore(a, e%4, b, edges[c]%4).shape >= g_ColorShapeGate) continue;
+			EdgeLinkInfo link = {0, &a, &b, e%4, edges[c]%4};
+			links[0] = link;
+			partners.push_back(std::make_pair(PairColor(links), edges[c]));
+		}
+		int n = min((int)partners.size(), (int)m_RelaxCandidates);
+		std::partial_sort(partners.begin(), partners.begin()+n, partners.end());
+		MatchBeliefs & beliefs = m_MatchBeliefs[e];
+		beliefs.n = n;
+		for (int i=0; i<n; i++) {
+			beliefs.edge[i] = partners[i].second;
+			colors[e*m_RelaxCandidates+i] = partners[i].first;
+		}
+		if (n > 0) { bestSum += partners[0].first; nBest++; }
+	}
+
+	// Colors a typical best match apart weigh e times less
+	float temperature = nBest ? max(bestSum/nBest, 1e-3f) : 1;
+	for (int e=0; e<nEdges; e++) {
+		MatchBeliefs & beliefs = m_MatchBeliefs[e];
+		float sum = 0;
+		for (int i=0; i<beliefs.n; i++)
+			sum += beliefs.p[i] = exp(-(colors[e*m_RelaxCandidates+i]-colors[e*m_RelaxCandidates])/temperature);
+		for (int i=0; i<beliefs.n; i++)
+			beliefs.p[i] /= sum;
+	}
+
+	/* Support for e = (A,k) matching f = (B,l): f's belief in e, plus for each
+	   side the corner loop it closes. If C lies against edge k+1 of A through
+	   its edge g, and D against edge l-1 of B through h, then C's edge g+1 has to
+	   meet D's edge h-1. The other side is the same with the signs flipped. */
+	std::vector<MatchBeliefs> next(m_MatchBeliefs);
+	auto EdgeId = [] (int e, int turn) { return (e & ~3) | ((e + turn + 4) & 3); };
+	auto Relax = [&] (int e) {
+		const MatchBeliefs & beliefs = m_MatchBeliefs[e];
+		MatchBeliefs & updated = next[e];
+		float sum = 0;
+		for (int i=0; i<beliefs.n; i++) {
+			int f = beliefs.edge[i];
+			float support = MatchBelief(m_MatchBeliefs, f, e);
+			int nTerms = 1;
+			for (int side=-1; side<=1; side+=2) {
+				int eSide = EdgeId(e, side), fSide = EdgeId(f, -side);
+				if (m_PuzzlePieces[eSide/4].edgeIsBorder[eSide%4] || m_PuzzlePieces[fSide/4].edgeIsBorder[fSide%4]) continue;
+				const MatchBeliefs & towardC = m_MatchBeliefs[eSide];
+				const MatchBeliefs & towardD = m_MatchBeliefs[fSide];
+				float loop = 0;
+				for (int c=0; c<towardC.n; c++) {
+					for (int d=0; d<towardD.n; d++) {
+						if (towardC.edge[c]/4 == towardD.edge[d]/4) continue;
+						loop += towardC.p[c]*towardD.p[d]*MatchBelief(m_MatchBeliefs, EdgeId(towardC.edge[c], side), EdgeId(towardD.edge[d], -side));
 					}
 				}
+				support += loop;
+				nTerms++;
 			}
+			sum += updated.p[i] = beliefs.p[i]*(1 + support/nTerms);
 		}
+		for (int i=0; i<beliefs.n; i++)
+			updated.p[i] /= sum;
+	};
+	for (int iteration=0; iteration<m_RelaxIterations; iteration++) {
+		std::atomic<int> nextEdge(0);
+		auto Worker = [&] () {
+			for (int e; (e = nextEdge++) < nEdges; )
+				if (m_MatchBeliefs[e].n > 0) Relax(e);
+		};
+		int nThreads = max(1, (int)std::thread::hardware_concurrency());
+		std::vector<std::thread> threads;
+		for (int t=1; t<nThreads; t++) threads.push_back(std::thread(Worker));
+		Worker();
+		for (int t=0; t<threads.size(); t++) threads[t].join();
+		m_MatchBeliefs.swap(next);
+
+		float change = 0;
+		for (int e=0; e<nEdges; e++)
+			for (int i=0; i<m_MatchBeliefs[e].n; i++)
+				change = max(change, abs(m_MatchBeliefs[e].p[i]-next[e].p[i]));
+		if (change < 1e-5f) break;
 	}
-	if (nMeasures == 0) 
-		DebugBreak();
-	qsort(measures, nMeasures, sizeof(EdgeLinkInfo), CompareEdgeMeasures);
-	float maxShapeMeasure = measures[nMeasures-1].measure;
-
-	// Compare by Color
-	std::ofstream out7("out7.txt", std::ofstream::out | std::ofstream::trunc);
-	//char buf[256];
-	//sprintf(buf, "\n%i\n", nMeasures);
-	//OutputDebugStringA(buf);
-	int count=0;
-	for (int i=0; i<nMeasures; i++) {
-		if (measures[i].measure < 4.) count++;
-		out7 << measures[i].measure << std::endl;
+}
+
+float JPuzzle::MatchBelief(const std::vector<MatchBeliefs> & beliefs, int e, int f)
+{
+	const MatchBeliefs & b = beliefs[e];
+	for (int i=0; i<b.n; i++)
+		if (b.edge[i] == f) return b.p[i];
+	return 0;
+}
+
+float JPuzzle::BeliefCost(std::vector<EdgeLinkInfo> & links)
+{
+	/* Negative log of the mutual belief of every link, matches outside both
+	   candidate lists cost as much as a one in a million belief */
+	float cost = 0;
+	for (int i=0; i<links.size(); i++) {
+		int e = 4*links[i].a->index+links[i].k, f = 4*links[i].b->index+links[i].l;
+		float belief = sqrt(MatchBelief(m_MatchBeliefs, e, f)*MatchBelief(m_MatchBeliefs, f, e));
+		cost -= log(max(belief, 1e-6f));
 	}
+	return cost;
+}
 
-	int nNewMeasures = min(count, nMeasures);
-	for (int i=0; i<nNewMeasures; i++) {
-		FindNeighbors(*measures[i].a, *measures[i].b, measures[i].k, measures[i].l, links);
-		measures[i].measure = CompareEdgesByColor(links); links.resize(0);
+void JPuzzle::BuildEdgeProfiles()
+{
+	/* One slot per height, on an even number of slots with room to spare for the
+	   longest edge. An edge of n heights starts at slot (size-n)/2. Read backwards
+	   against a partner of the other parity the two middles are half a slot apart,
+	   so the reversed profile is kept with both roundings and the partner's parity
+	   picks one. Either way the shorter edge of a pair lands on the heights
+	   (long-short)/2 into the longer one, rounded down. */
+	int longest = 0;
+	for (int i=0; i<m_nPuzzlePieces; i++)
+		for (int k=0; k<4; k++)
+			longest = max(longest, (int)m_PuzzlePieces[i].projectedPoints[k].size());
+	m_ProfileSize = (longest+2+7) & ~7;
+
+	for (int i=0; i<m_nPuzzlePieces; i++) {
+		PuzzlePiece & piece = m_PuzzlePieces[i];
+		for (int k=0; k<4; k++) {
+			const std::vector<float> & heights = piece.projectedPoints[k];
+			int n = heights.size();
+			int start = (m_ProfileSize-n)/2;
+			int shift[2] = {(m_ProfileSize-n+1)/2, (m_ProfileSize-n)/2+1};
+			piece.profile[k].setZero(m_ProfileSize);
+			piece.reversedProfile[k][0].setZero(m_ProfileSize);
+			piece.reversedProfile[k][1].setZero(m_ProfileSize);
+			piece.heightSums[k].assign(n+1, 0);
+			for (int j=0; j<n; j++) {
+				piece.profile[k][start+j] = heights[j];
+				piece.reversedProfile[k][0][m_ProfileSize-1-j-shift[0]] = heights[j];
+				piece.reversedProfile[k][1][m_ProfileSize-1-j-shift[1]] = heights[j];
+				piece.heightSums[k][j+1] = piece.heightSums[k][j] + abs(heights[j]);
+			}
+		}
 	}
-	EdgeLinkInfo * oldMeasures = new EdgeLinkInfo[nMeasures];
-	memcpy(oldMeasures, measures, sizeof(EdgeLinkInfo)*nMeasures);
-	qsort(measures, nNewMeasures, sizeof(EdgeLinkInfo), CompareEdgeMeasures);
-	float maxColorMeasure = measures[nNewMeasures-1].measure;
-	
-	/*
-	for (int i=0; i<nMeasures; i++) {
-		if (i < nNewMeasures)
-			out7 << oldMeasures[i].measure*(maxShapeMeasure/maxColorMeasure) << std::endl;
-		else out7 << 0 << std::endl;
-	}*/
-	for (int i=0; i<nNewMeasures; i++) {		
-		FindNeighbors(*measures[i].a, *measures[i].b, measures[i].k, measures[i].l, links); 
-		out7 << measures[i].measure << ' ' << links.size() << ' ' << measures[i].k << ' ' << measures[i].l << ' ' << measures[i].a->index << ' ' << measures[i].b->index << ' ' <<  CompareEdgesByColor(links) << ' ' << CompareEdgesByColor(links) << std::endl;
-		links.resize(0);
+}
+
+float JPuzzle::ProfileDistance(PuzzlePiece & a, int k, PuzzlePiece & b, int l, float profileSum)
+{
+	/* profileSum runs over every slot, so it also holds the heights of the longer
+	   edge past both ends of the shorter one. Those are taken back out, leaving
+	   the mean over the heights both edges share. */
+	int na = a.projectedPoints[k].size(), nb = b.projectedPoints[l].size();
+	const std::vector<double> & sums = na > nb ? a.heightSums[k] : b.heightSums[l];
+	int longSize = max(na, nb), shortSize = min(na, nb);
+	int offset = (longSize-shortSize)/2;
+	double outside = sums[longSize] - sums[offset+shortSize] + sums[offset];
+	return (float)max(0.0, profileSum-outside)/shortSize;
+}
+
+void JPuzzle::BuildEdgeIndex()
+{
+	/* Edges are only told apart by length. Ruling out tab/tab and blank/blank
+	   pairs by the sign of the largest bump changes what the shape measure places
+	   and can leave the last piece of a hole without any fit. */
+	int nEdges = 4*m_nPuzzlePieces;
+	m_EdgeLength.assign(nEdges, 0);
+	m_EdgeBuckets.clear();
+	for (int i=0; i<m_nPuzzlePieces; i++) {
+		PuzzlePiece & piece = m_PuzzlePieces[i];
+		for (int k=0; k<4; k++) {
+			if (piece.edgeIsBorder[k]) continue;
+			int e = 4*piece.index+k;
+			m_EdgeLength[e] = (piece.endPoints[k]-piece.endPoints[(k+1)%4]).norm();
+			size_t bucket = (int)(m_EdgeLength[e]/m_EdgeLengthTolerance);
+			if (bucket >= m_EdgeBuckets.size()) m_EdgeBuckets.resize(bucket+1);
+			m_EdgeBuckets[bucket].push_back(e);
+		}
+	}
+}
+
+bool JPuzzle::EdgesCompatible(PuzzlePiece & a, int k, PuzzlePiece & b, int l)
+{
+	int e1 = 4*a.index+k, e2 = 4*b.index+l;
+	if (a.edgeIsBorder[k] || b.edgeIsBorder[l]) return false;
+	return abs(m_EdgeLength[e1] - m_EdgeLength[e2]) <= m_EdgeLengthTolerance;
+}
+
+void JPuzzle::CompatibleEdges(PuzzlePiece & a, int k, std::vector<int> & edges)
+{
+	/* Buckets are as wide as the length tolerance, so a partner is at most one
+	   bucket away. Edges of a itself are left out. */
+	edges.resize(0);
+	if (a.edgeIsBorder[k]) return;
+	int e = 4*a.index+k;
+	int lengthBucket = (int)(m_EdgeLength[e]/m_EdgeLengthTolerance);
+	for (int lb=max(lengthBucket-1, 0); lb<=lengthBucket+1 && lb<(int)m_EdgeBuckets.size(); lb++) {
+		for (int j=0; j<m_EdgeBuckets[lb].size(); j++) {
+			int other = m_EdgeBuckets[lb][j];
+			if (other/4 != a.index && abs(m_EdgeLength[e] - m_EdgeLength[other]) <= m_EdgeLengthTolerance)
+				edges.push_back(other);
+		}
 	}
-	out7.close();
+}
+
+void JPuzzle::BuildPairScores()
+{
+	/* Unordered pairs of edges of different pieces, packed as the upper triangle
+	   of the 4n x 4n edge matrix. Both measures are symmetric, so (a,k,b,l) and
+	   (b,l,a,k) share an entry. Pieces are walked in tiles so the features of
+	   both tiles stay in cache, and threads take whole tiles. */
+	int nEdges = 4*m_nPuzzlePieces;
+	PairScore unset = {FLT_MAX, -1};
+	m_PairScores.assign((size_t)nEdges*(nEdges-1)/2, unset);
+
+	const int tileSize = 16;
+	int nTiles = (m_nPuzzlePieces+tileSize-1)/tileSize;
+	std::vector<std::pair<int, int> > tiles;
+	for (int ti=0; ti<nTiles; ti++)
+		for (int tj=ti; tj<nTiles; tj++)
+			tiles.push_back(std::make_pair(ti, tj));
+
+	std::atomic<int> nextTile(0);
+	auto Worker = [&] () {
+		// Each edge is scored against every candidate edge of the other tile in one batch
+		std::vector<EdgeLinkInfo> batch;
+		std::vector<const float *> candidates;
+		std::vector<float> sums;
+		for (int t; (t = nextTile++) < (int)tiles.size(); ) {
+			int aEnd = min((tiles[t].first+1)*tileSize, m_nPuzzlePieces);
+			int bEnd = min((tiles[t].second+1)*tileSize, m_nPuzzlePieces);
+			for (int i=tiles[t].first*tileSize; i<aEnd; i++) {
+				PuzzlePiece & a = m_PuzzlePieces[i];
+				for (int k=0; k<4; k++) {
+					if (a.edgeIsBorder[k]) continue;
+					batch.resize(0);
+					candidates.resize(0);
+					for (int j=max(i+1, tiles[t].second*tileSize); j<bEnd; j++) {
+						PuzzlePiece & b = m_PuzzlePieces[j];
+						for (int l=0; l<4; l++) {
+							if (!EdgesCompatible(a, k, b, l)) continue;
+							float dist = abs(m_EdgeLength[4*a.index+k] - m_EdgeLength[4*b.index+l]);
+							EdgeLinkInfo link = {dist, &a, &b, k, l};
+							batch.push_back(link);
+							candidates.push_back(b.reversedProfile[l][a.projectedPoints[k].size()%2].data());
+						}
+					}
+					if (batch.empty()) continue;
+					sums.resize(batch.size());
+					ShapeDistanceBatch(a.profile[k].data(), candidates.data(), batch.size(), m_ProfileSize, sums.data());
+
+					for (int c=0; c<batch.size(); c++) {
+						PuzzlePiece & b = *batch[c].b;
+						int l = batch[c].l;
+						PairScore & score = GetPairScore(a, k, b, l);
+						score.shape = batch[c].measure + ProfileDistance(a, k, b, l, sums[c]);
+						if (score.shape < g_ColorShapeGate)
+							score.color = EdgeColorDistance(a, k, b, l);
+					}
+				}
+			}
+		}
+	};
+	int nThreads = max(1, min((int)std::thread::hardware_concurrency(), (int)tiles.size()));
+	std::vector<std::thread> threads;
+	for (int t=1; t<nThreads; t++) threads.push_back(std::thread(Worker));
+	Worker();
+	for (int t=0; t<threads.size(); t++) threads[t].join();
+}
 
-	MovePiece(measures[0]);
+JPuzzle::PairScore & JPuzzle::GetPairScore(PuzzlePiece & a, int k, PuzzlePiece & b, int l)
+{
+	size_t e1 = 4*a.index+k, e2 = 4*b.index+l;
+	if (e1 > e2) std::swap(e1, e2);
+	size_t nEdges = 4*m_nPuzzlePieces;
+	return m_PairScores[e1*(2*nEdges-e1-1)/2 + (e2-e1-1)];
+}
 
-	FindNeighbors(*measures[0].a, *measures[0].b, measures[0].k, measures[0].l, links); 
+float JPuzzle::PairShape(std::vector<EdgeLinkInfo> & links)
+{
+	float measure = 0;
 	for (int i=0; i<links.size(); i++) {
-		links[i].a->adjPieces[links[i].k] = links[i].b;
-		links[i].a->edgeCovered[links[i].k] = 1;
-		links[i].b->adjPieces[links[i].l] = links[i].a;
-		links[i].b->edgeCovered[links[i].l] = 1;
-		links[i].b->isAdded = 1;
+		float shape = GetPairScore(*links[i].a, links[i].k, *links[i].b, links[i].l).shape;
+		if (shape == FLT_MAX) return FLT_MAX;
+		measure += shape;
 	}
+	return measure;
+}
 
-	delete[] measures;
-	delete[] oldMeasures;
+float JPuzzle::PairColor(std::vector<EdgeLinkInfo> & links)
+{
+	/* Pairs that were gated out by shape are filled in on first use */
+	float measure = 0;
+	for (int i=0; i<links.size(); i++) {
+		PairScore & score = GetPairScore(*links[i].a, links[i].k, *links[i].b, links[i].l);
+		if (score.color < 0)
+			score.color = EdgeColorDistance(*links[i].a, links[i].k, *links[i].b, links[i].l);
+		measure += score.color;
+	}
+	return measure;
 }
 
 float JPuzzle::CompareEdgesByShape(std::vector<EdgeLinkInfo> & links) 
@@ -1974,30 +2890,9 @@ float JPuzzle::CompareEdgesByShape(std::vector<EdgeLinkInfo> & links)
 		//std::ofstream out1("out1.txt");
 		//std::ofstream out2("out2.txt");
 
-		std::vector<float> * longProjectedPoints;
-		std::vector<float> * shortProjectedPoints;
-	
-		if (a.projectedPoints[k].size() > b.projectedPoints[l].size()) {
-			longProjectedPoints = &a.projectedPoints[k], shortProjectedPoints = &b.projectedPoints[l];
-		} else {
-			shortProjectedPoints = &a.projectedPoints[k], longProjectedPoints = &b.projectedPoints[l];
-		}
-
-		auto Compare = [&] (int offset) {
-			float sum=0;
-			int longEdgeSize = longProjectedPoints->size();
-			for (int i=0, end=shortProjectedPoints->size(); i<end; i++) {
-				float hs = (*shortProjectedPoints)[end-i-1];
-				//out1 << i << ' ' << hs << std::endl;
-				float hl = (*longProjectedPoints)[i+offset];
-				//out2 << i << ' ' << -hl << std::endl;
-				sum += abs(hs+hl);
-			}
-			return sum;
-		};
-
-		int offset = (longProjectedPoints->size()-shortProjectedPoints->size())/2;
-		measure += dist + Compare(offset)/shortProjectedPoints->size();
+		// The edges meet head to tail, so one profile is read backwards
+		const EdgeProfile & reversed = b.reversedProfile[l][a.projectedPoints[k].size()%2];
+		measure += dist + ProfileDistance(a, k, b, l, (a.profile[k] + reversed).cwiseAbs().sum());
 	}
 	return measure;
 }
@@ -2013,29 +2908,7 @@ float JPuzzle::CompareEdgesByColor(std::vector<EdgeLinkInfo> & links)
 		//std::ofstream out1("out1.txt");
 		//std::ofstream out2("out2.txt");
 
-		int layerIndex=m_MaxColorLayers-2;
-		int minSize = a.edgeColors[k][layerIndex+1].size();
-		if (b.edgeColors[l][layerIndex+1].size() < minSize) {
-			minSize = b.edgeColors[l][layerIndex+1].size();
-		}
-	
-		auto ExtractLeftRightColors = [minSize,k,l,&a,&b] (int layerIndex, Color * leftColors, Color * rightColors) {
-			int offsetA=a.edgeColors[k][layerIndex].size()-minSize;
-			int offsetB=b.edgeColors[l][layerIndex].size()-minSize;
-			for (int i=0; i<minSize; i++) {
-				leftColors[i] = a.edgeColors[k][layerIndex][i+offsetA];
-				rightColors[i] = b.edgeColors[l][layerIndex][offsetB+(minSize-i-1)];
-				//leftColors[i] = a.edgeColors[k][layerIndex][i];
-				//rightColors[i] = b.edgeColors[l][layerIndex][b.edgeColors[l][layerIndex].size()-i-1];
-			}
-		};
-
-		if (minSize >= 1024)
-			DebugBreak();
-
-		ExtractLeftRightColors(layerIndex, m_LeftColors[1], m_RightColors[0]);
-		ExtractLeftRightColors(layerIndex+1, m_LeftColors[0], m_RightColors[1]);
-		measure += MGC(m_LeftColors, m_RightColors, minSize, minSize);//*/
+		measure += EdgeColorDistance(a, k, b, l);
 
 		//if (k==2 && l==0)
 		//	int a=0;
@@ -2177,65 +3050,164 @@ void JPuzzle::MovePiece(EdgeLinkInfo & measure)
 		m_AddedPuzzlePieces.push_back(&b);
 }
 
-MatrixXd dummyCov(MatrixXd& mat, Vector3d& mu) 
+/* MGC only needs 3x3 statistics. Define JPUZZLE_MGC_FLOAT to accumulate them in
+   single precision; the inverse always runs in double because a gray edge gives a
+   covariance that is nearly rank one, which float cofactors cannot resolve. */
+#ifdef JPUZZLE_MGC_FLOAT
+typedef float MgcScalar;
+#else
+typedef double MgcScalar;
+#endif
+typedef Matrix<MgcScalar, 3, 3> MgcMatrix;
+typedef Matrix<MgcScalar, 3, 1> MgcVector;
+
+static Matrix3d InverseSymmetric3(const Matrix3d & S)
 {
-	int rows = mat.rows();
-	MatrixXd M(rows + 9, 3);
-	M << mat, 0, 0, 0, 1, 1, 1, -1, -1, -1, 0, 0, 1, 0, 1, 0, 1, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1;
-	VectorXd ones;
-	ones.setOnes(rows + 9);
+	/* Adjugate over determinant, S is symmetric so only the upper cofactors are needed */
+	Matrix3d adj;
+	adj(0,0) = S(1,1)*S(2,2) - S(1,2)*S(1,2);
+	adj(0,1) = S(0,2)*S(1,2) - S(0,1)*S(2,2);
+	adj(0,2) = S(0,1)*S(1,2) - S(0,2)*S(1,1);
+	adj(1,1) = S(0,0)*S(2,2) - S(0,2)*S(0,2);
+	adj(1,2) = S(0,1)*S(0,2) - S(0,0)*S(1,2);
+	adj(2,2) = S(0,0)*S(1,1) - S(0,1)*S(0,1);
+	adj(1,0) = adj(0,1);
+	adj(2,0) = adj(0,2);
+	adj(2,1) = adj(1,2);
+	double det = S(0,0)*adj(0,0) + S(0,1)*adj(1,0) + S(0,2)*adj(2,0);
+	return adj/det;
+}
 
-	Matrix3d S = 1.0 / (rows + 8)*(M - ones*mu.transpose()).transpose()*(M - ones*mu.transpose());
+Matrix3d dummyCov(const Matrix3d & scatter, const Vector3d & mu, int rows) 
+{
+	/* Covariance of the rows with nine dummy rows appended, (0,0,0), +-(1,1,1) and
+	   +-e_i, so flat edges still give an invertible matrix. The dummies sum to zero,
+	   their scatter around mu is 2J + 2I + 9 mu mu^T. */
+	Matrix3d S = scatter + 9*mu*mu.transpose();
+	S.array() += 2;
+	S.diagonal().array() += 2;
+	S /= rows + 8;
+
+	return InverseSymmetric3(S);
+}
 
-	return S.inverse();
+static float MgcDistance(const Vector3d & uiL, const Matrix3d & SL, const Vector3d & ujR, const Matrix3d & SR, const Vector3d & uLR, const Matrix3d & SLR, int rows)
+{
+	/* Means and centered scatters of the gradients inside each piece (GL, GR)
+	   and across the seam (GijLR; GjiRL is its negation). Each Mahalanobis sum
+	   is tr(S^-1 * scatter) of the seam gradients around the inside mean. */
+	Matrix3d SiLpinv = dummyCov(SL, uiL, rows);
+	Matrix3d SjRpinv = dummyCov(SR, ujR, rows);
+
+	// Scatter of GijLR around uiL and of GjiRL = -GijLR around ujR
+	Vector3d offsetLR = uLR - uiL;
+	Vector3d offsetRL = uLR + ujR;
+	Matrix3d XLR = SLR + rows*offsetLR*offsetLR.transpose();
+	Matrix3d XRL = SLR + rows*offsetRL*offsetRL.transpose();
+
+	double DLR = max(SiLpinv.cwiseProduct(XLR).sum(), 0.0);
+	double DRL = max(SjRpinv.cwiseProduct(XRL).sum(), 0.0);
+	return sqrt(DLR) + sqrt(DRL);
 }
 
 float JPuzzle::MGC(Color ** left, Color ** right, int leftSize, int rightSize) {
 	
+	/* One pass keeps running means and centered scatters (Welford) of all three
+	   gradients, in fixed 3x3 storage */
 	int rows = leftSize;
 
-	MatrixXd GL(rows, 3), GR(rows, 3), GijLR(rows, 3), GjiRL(rows, 3);
-	Vector3d uiL(0.0, 0.0, 0.0);
-	Vector3d ujR(0.0, 0.0, 0.0);
+	MgcVector uiL(MgcVector::Zero()), ujR(MgcVector::Zero()), uLR(MgcVector::Zero());
+	MgcMatrix SL(MgcMatrix::Zero()), SR(MgcMatrix::Zero()), SLR(MgcMatrix::Zero());
 
 	for (int r = 0; r < rows; ++r) {
-		Color rgb[4];
+		const Color & l0 = left[0][r];
+		const Color & l1 = left[1][r];
+		const Color & r0 = right[0][r];
+		const Color & r1 = right[1][r];
+
+		MgcVector GL(l1.x - l0.x, l1.y - l0.y, l1.z - l0.z);
+		MgcVector GR(r0.x - r1.x, r0.y - r1.y, r0.z - r1.z);
+		MgcVector GijLR(r0.x - l1.x, r0.y - l1.y, r0.z - l1.z);
+
+		MgcScalar w = MgcScalar(1)/(r+1);
+		MgcVector dL = GL - uiL, dR = GR - ujR, dLR = GijLR - uLR;
+		uiL += w*dL;
+		ujR += w*dR;
+		uLR += w*dLR;
+		SL.noalias() += dL*(GL - uiL).transpose();
+		SR.noalias() += dR*(GR - ujR).transpose();
+		SLR.noalias() += dLR*(GijLR - uLR).transpose();
+	}
 
-		rgb[0] = left[0][r];
-		rgb[1] = left[1][r];
+	return MgcDistance(uiL.cast<double>(), SL.cast<double>(), ujR.cast<double>(), SR.cast<double>(), uLR.cast<double>(), SLR.cast<double>(), rows);
+}
 
-		rgb[2] = right[0][r];
-		rgb[3] = right[1][r];
-		
-		for (int ch = 0; ch<3; ch++){
-			GL(r, ch) = rgb[1][ch] - rgb[0][ch];
-			GR(r, ch) = rgb[2][ch] - rgb[3][ch];
-			GijLR(r, ch) = rgb[2][ch] - rgb[1][ch];
-			GjiRL(r, ch) = rgb[1][ch] - rgb[2][ch];
-			uiL(ch) += GL(r, ch);
-			ujR(ch) += GR(r, ch);
+void JPuzzle::ComputeGradientSums(PuzzlePiece & piece)
+{
+	/* Both sides of a pair see the same inside gradient, ring 4 minus ring 5, and
+	   a pair only compares the last minSize colors of each edge. Keeping running
+	   sums from the end makes these statistics a lookup for any pair. */
+	int layerIndex=m_MaxColorLayers-2;
+	for (int k=0; k<4; k++) {
+		std::vector<Color> & ring = piece.edgeColors[k][layerIndex];
+		std::vector<Color> & insetRing = piece.edgeColors[k][layerIndex+1];
+		int n = min(ring.size(), insetRing.size());
+		std::vector<GradientSums> & sums = piece.gradientSums[k];
+		sums.resize(n+1);
+		memset(&sums[0], 0, sizeof(GradientSums));
+		for (int i=0; i<n; i++) {
+			const Color & c = ring[ring.size()-1-i];
+			const Color & inset = insetRing[insetRing.size()-1-i];
+			double g[3] = {c.x - inset.x, c.y - inset.y, c.z - inset.z};
+			GradientSums & prev = sums[i];
+			GradientSums & next = sums[i+1];
+			for (int ch=0; ch<3; ch++)
+				next.sum[ch] = prev.sum[ch] + g[ch];
+			next.outer[0] = prev.outer[0] + g[0]*g[0];
+			next.outer[1] = prev.outer[1] + g[0]*g[1];
+			next.outer[2] = prev.outer[2] + g[0]*g[2];
+			next.outer[3] = prev.outer[3] + g[1]*g[1];
+			next.outer[4] = prev.outer[4] + g[1]*g[2];
+			next.outer[5] = prev.outer[5] + g[2]*g[2];
 		}
 	}
-	uiL /= rows;
-	ujR /= rows;
-
-	VectorXd ones;
-	ones.setOnes(rows);
-
-	MatrixXd SiLpinv = dummyCov(GL, uiL);//pinv(SiL);
-	MatrixXd SjRpinv = dummyCov(GR, ujR);//pinv(SjR);
-
-	double DLR = 0.0;//ones.dot(lr);
-	double DRL = 0.0;//ones.dot(rl);
-
-	MatrixXd XLR = (GijLR - ones*uiL.transpose());
-	MatrixXd XRL = (GjiRL - ones*ujR.transpose());
+}
 
-	for (int r = 0; r<rows; r++) {
-		DLR += XLR.row(r)*SiLpinv*XLR.row(r).transpose();
-		DRL += XRL.row(r)*SjRpinv*XRL.row(r).transpose();
+float JPuzzle::EdgeColorDistance(PuzzlePiece & a, int k, PuzzlePiece & b, int l)
+{
+	/* The inside statistics of both edges come from their running sums, only the
+	   gradient across the seam is gathered per pair. The last minSize colors of
+	   a are walked forward and those of b backward. */
+	int layerIndex=m_MaxColorLayers-2;
+	int minSize = min(a.gradientSums[k].size(), b.gradientSums[l].size()) - 1;
+	if (minSize <= 0) return FLT_MAX;	// an edge without colors matches nothing
+	const Color * ringA = a.edgeColors[k][layerIndex].data() + a.edgeColors[k][layerIndex].size() - minSize;
+	const Color * ringB = b.edgeColors[l][layerIndex].data() + b.edgeColors[l][layerIndex].size() - 1;
+
+	MgcVector uLR(MgcVector::Zero());
+	MgcMatrix SLR(MgcMatrix::Zero());
+	for (int i=0; i<minSize; i++) {
+		const Color & l1 = ringA[i];
+		const Color & r0 = *(ringB-i);
+		MgcVector GijLR(r0.x - l1.x, r0.y - l1.y, r0.z - l1.z);
+		MgcScalar w = MgcScalar(1)/(i+1);
+		MgcVector d = GijLR - uLR;
+		uLR += w*d;
+		SLR.noalias() += d*(GijLR - uLR).transpose();
 	}
-	return sqrt(DLR) + sqrt(DRL);
+
+	auto GradientStats = [minSize] (const GradientSums & sums, Vector3d & mean, Matrix3d & scatter) {
+		mean = Vector3d(sums.sum[0], sums.sum[1], sums.sum[2])/minSize;
+		scatter << sums.outer[0], sums.outer[1], sums.outer[2],
+			sums.outer[1], sums.outer[3], sums.outer[4],
+			sums.outer[2], sums.outer[4], sums.outer[5];
+		scatter -= minSize*mean*mean.transpose();
+	};
+	Vector3d uiL, ujR;
+	Matrix3d SL, SR;
+	GradientStats(a.gradientSums[k][minSize], uiL, SL);
+	GradientStats(b.gradientSums[l][minSize], ujR, SR);
+	return MgcDistance(uiL, SL, ujR, SR, uLR.cast<double>(), SLR.cast<double>(), minSize);
 }
 
 std::vector<JPuzzle::Pocket> JPuzzle::FindPockets(){
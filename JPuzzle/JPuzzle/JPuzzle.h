@@ -8,12 +8,26 @@
 #include <Eigen/Dense>
 #include <vector>
 #include <list>
+#include <map>
+#include <queue>
 using namespace Eigen;
 
 #pragma comment(lib, "d3d10")
 #pragma comment(lib, "d3dx10")
 
 const int g_TextureSize = 356;
+/* Edge pairs with a shape distance above this never get their colors compared */
+const float g_ColorShapeGate = 4.5f;
+
+/* Header of an uncompressed <sheet>.rgba scan, followed by height rows of
+   8-bit RGBA texels, pitch bytes apart. Large sheets are read through a
+   memory mapping so they never have to fit in memory at once. */
+struct RawImageHeader {
+	char magic[4];	// "RGBA"
+	int width;
+	int height;
+	int pitch;
+};
 
 struct SimpleVertex
 {
@@ -21,6 +35,10 @@ struct SimpleVertex
     D3DXVECTOR2 Tex;
 };
 
+/* Texels are kept as 8-bit RGBA; convert to float only where a kernel needs it */
+typedef Matrix<unsigned char, 4, 1> Vector4uc;
+static_assert(sizeof(Vector4uc) == 4, "texels must stay tightly packed RGBA8");
+
 struct Color {
 	Color():x(0),y(0),z(0),w(0){}
 	float x,y,z,w;
@@ -30,6 +48,12 @@ struct Color {
 		z=vec.z();
 		w=vec.w();
 	}
+	void operator=(Vector4uc & vec) {
+		x=vec.x();
+		y=vec.y();
+		z=vec.z();
+		w=vec.w();
+	}
 	float operator[](int idx) {
 		switch(idx){
 		case 0:
@@ -48,30 +72,36 @@ struct Color {
 };
 
 struct Texture {
-	Texture():texels(0) {}
+	Texture():width(0), height(0), texels(0) {}
 	Texture(Texture & cpy) {
 		width=cpy.width, height=cpy.height; 
-		texels = new Vector4f[width*height];
-		memcpy(texels, cpy.texels, width*height*sizeof(Vector4f));
+		texels = new Vector4uc[width*height];
+		memcpy(texels, cpy.texels, width*height*sizeof(Vector4uc));
 	}
-	~Texture() {}
+	~Texture() { delete[] texels; }
 
 	int width;
 	int height;
-	Vector4f * texels;
+	Vector4uc * texels;
 
 	void Init(int _width, int _height) {
+		delete[] texels;
 		width = _width;
 		height = _height;
-		texels = new Vector4f[width*height];
-		memset(texels, 0, width*height*sizeof(Vector4f));
+		texels = new Vector4uc[width*height];
+		memset(texels, 0, width*height*sizeof(Vector4uc));
 	}
 
 	void ClearChannels() {
-		memset(texels, 0, width*height*sizeof(Vector4f));
+		memset(texels, 0, width*height*sizeof(Vector4uc));
 	}
 
-	Vector4f & operator()(int i, int j) {
+	/* Packed RGBA8 rows, width*4 bytes apart */
+	unsigned char * Data() {
+		return (unsigned char*)texels;
+	}
+
+	Vector4uc & operator()(int i, int j) {
 		assert(i>=0 && i<height && j>=0 && j<width);
 		return texels[width*i + j];
 	}
@@ -79,19 +109,34 @@ struct Texture {
 	bool Inside(int i, int j) {
 		return (i>=0 && i<height && j>=0 && j<width);
 	}
+
+private:
+	void operator=(const Texture &);
 };
 
 class JPuzzle {
 private:
 	static const int m_MaxColorLayers=6;
+	/* Bump whenever ProcessPuzzlePiece or the cached layout changes */
+	static const unsigned int m_FeatureCacheVersion=6;
+	/* Edge heights laid out on m_ProfileSize slots around the middle of the grid,
+	   zero past the ends of the edge */
+	typedef Matrix<float, Dynamic, 1> EdgeProfile;
 	 
+	/* Running sums of an edge's inside color gradient (inset ring 4 minus ring 5),
+	   taken from the end of the edge, where color comparisons align a pair */
+	struct GradientSums {
+		double sum[3];
+		double outer[6];	// xx xy xz yy yz zz
+	};
+
 	struct EdgePoint {
 		Vector2f pos;
 		float k;
 		float w;
 	};
 	struct PuzzlePiece {
-		PuzzlePiece():isAdded(0), isBorderPiece(0) {memset(edgeCovered, 0, 4); memset(edgeIsBorder, 0, 4); memset(adjPieces, 0, 4*sizeof(PuzzlePiece*)); }
+		PuzzlePiece():isAdded(0), isBorderPiece(0), gridX(0), gridY(0), gridRotation(-1), SRVPuzzleTexture(0) {memset(edgeCovered, 0, 4); memset(edgeIsBorder, 0, 4); memset(adjPieces, 0, 4*sizeof(PuzzlePiece*)); }
 		Matrix4f transform;
 		Matrix4f rotation;
 		Vector2f endPoints[4];
@@ -100,6 +145,10 @@ private:
 		std::vector<EdgePoint> edges[4];	
 		std::vector<Color> edgeColors[4][m_MaxColorLayers];
 		std::vector<float> projectedPoints[4];
+		EdgeProfile profile[4];
+		EdgeProfile reversedProfile[4][2];	// [parity of the partner edge's length]
+		std::vector<double> heightSums[4];	// [n] sums |height| over the first n
+		std::vector<GradientSums> gradientSums[4];	// [n] covers the last n colors
 
 		int index;
 		bool isAdded;
@@ -109,24 +158,32 @@ private:
 		float totalCurvature[4];
 		float totalLength[4];
 		PuzzlePiece * adjPieces[4];
+		int gridX, gridY;	// lattice cell once placed
+		int gridRotation;	// edge e faces direction (e+gridRotation)%4, -1 when off the grid
 
-		std::vector<int> borders(){
-			std::vector<int> borders;
+		// Border edge indices in increasing order, returns how many there are
+		int borders(int * border){
+			int n = 0;
 			for (int i = 0; i < 4; ++i) {
 				if (edgeIsBorder[i]){
-					borders.push_back(i);
+					border[n++] = i;
 				}
 			}
-			return borders;
+			return n;
+		}
+		int nBorders(){
+			int border[4];
+			return borders(border);
 		}
 		int left(){
-			std::vector<int> border = borders();
-			if (border.size() == 1){
+			int border[4];
+			int n = borders(border);
+			if (n == 1){
 				return (border[0] + 3) % 4;
 			}
-			else if (border.size() == 2){
-				int border1 = min(border[0], border[1]);
-				int border2 = max(border[0], border[1]);
+			else if (n == 2){
+				int border1 = border[0];
+				int border2 = border[1];
 				if (border2 == border1 + 1){
 					return (border1 + 3) % 4;
 				}
@@ -138,13 +195,14 @@ private:
 				assert(0);
 		}
 		int right(){
-			std::vector<int> border = borders();
-			if (border.size() == 1){
+			int border[4];
+			int n = borders(border);
+			if (n == 1){
 				return (border[0] + 1) % 4;
 			}
-			else if (border.size() == 2){
-				int border1 = min(border[0], border[1]);
-				int border2 = max(border[0], border[1]);
+			else if (n == 2){
+				int border1 = border[0];
+				int border2 = border[1];
 				if (border2 == border1 + 1){
 					return (border2 + 1) % 4;
 				}
@@ -171,9 +229,130 @@ private:
 		int l;
 	};
 
-	/* Temporary Memory */
-	Color * m_LeftColors[2];
-	Color * m_RightColors[2];
+	/* Scores of every pair of edges, filled once and shared by all assembly steps */
+	struct PairScore {
+		float shape;
+		float color;	// -1 until computed
+	};
+	std::vector<PairScore> m_PairScores;
+
+	/* Non-border edges bucketed by chord length, built once after the features
+	   are known. Edge e is edge e%4 of piece e/4. */
+	static const int m_EdgeLengthTolerance=12;
+	std::vector<float> m_EdgeLength;
+	std::vector<std::vector<int> > m_EdgeBuckets;	// [lengthBucket]
+
+	/* Placed pieces on an integer lattice. Directions are left, bottom, right and
+	   top; a piece's edge e faces direction (e+rotation)%4. The grid keeps one
+	   empty cell of margin around the placed pieces. */
+	struct GridCell {
+		int piece;		// -1 when empty
+		int rotation;
+	};
+	std::vector<GridCell> m_Grid;
+	int m_GridX0, m_GridY0;	// lattice coordinates of cell 0
+	int m_GridWidth, m_GridHeight;
+	void BuildGrid();
+	int GridCellIndex(int x, int y) {
+		x -= m_GridX0; y -= m_GridY0;
+		return x < 0 || y < 0 || x >= m_GridWidth || y >= m_GridHeight ? -1 : y*m_GridWidth + x;
+	}
+	bool GridSlotLinks(int cell, PuzzlePiece & b, int rotation, std::vector<EdgeLinkInfo> & links) { return GridSlotLinks(m_Grid.data(), cell, b, rotation, links); }
+	bool GridSlotLinks(const GridCell * grid, int cell, PuzzlePiece & b, int rotation, std::vector<EdgeLinkInfo> & links);
+	void PlacePiece(int cell, PuzzlePiece & b, int rotation);
+
+	/* Candidate placements in the empty cells next to placed pieces, kept between
+	   steps. A placement only rescores the cells around the new piece; entries of
+	   filled cells, placed pieces or rescored cells are dropped when they surface. */
+	struct SlotCandidate {
+		int cell;
+		int b;			// free piece placed there
+		unsigned char rotation;	// of b
+		unsigned char nLinks;	// placed neighbours of the cell, more is better
+		bool gated;		// mean shape under the gate, ranked by color
+		float measure;	// color when gated, mean shape otherwise
+		unsigned int version;
+		bool operator<(const SlotCandidate & other) const {
+			if (nLinks != other.nLinks) return nLinks < other.nLinks;
+			if (gated != other.gated) return !gated;
+			return measure > other.measure;
+		}
+	};
+	std::vector<SlotCandidate> m_Frontier;	// max-heap, reserved when assembly starts
+	std::vector<int> m_OpenSlots;	// empty cells with a placed neighbour
+	std::vector<int> m_OpenSlotIndex;	// position in m_OpenSlots by cell, -1 if not open
+	void OpenSlot(int cell);
+	void CloseSlot(int cell);
+	std::vector<unsigned int> m_SlotVersion;	// by cell
+	std::vector<int> m_SlotLive;	// kept entries of the current version whose piece is still free
+	int m_SlotCandidates;	// best entries kept per slot
+	float m_SlotShapeGate;	// mean shape under which candidates are ranked by color
+	/* Scratch reused by every step so the interior loop stays off the heap */
+	std::vector<int> m_SlotEdges;
+	std::vector<SlotCandidate> m_SlotScored;
+	std::vector<EdgeLinkInfo> m_SlotLinks;
+	std::vector<EdgeLinkInfo> m_StepLinks;
+	void PushSlotCandidate(const SlotCandidate & entry);
+
+	/* Beam search keeps the best partial assemblies instead of committing to the
+	   single best placement. Each state is a copy of the grid with the moves that
+	   led to it; the winner's moves are then replayed one per AddPiece. Moves are
+	   kept in lattice coordinates, the replay lays the grid out again whenever a
+	   piece takes a margin cell. */
+	struct BeamMove {
+		int x, y;
+		int b;
+		int rotation;
+	};
+	struct BeamState {
+		std::vector<GridCell> grid;
+		std::vector<char> placed;	// by piece
+		std::vector<BeamMove> moves;
+		float cost;		// summed color distance of every seam made
+		int nSeams;
+		unsigned long long hash;	// of the placements, equal assemblies reached in another order collide
+	};
+	struct BeamChild {
+		int parent;
+		BeamMove move;
+		float cost;
+		int nSeams;
+		unsigned long long hash;
+		float Rank() const { return cost/max(nSeams, 1); }
+	};
+	/* Buffers of one beam worker, kept across steps */
+	struct BeamScratch {
+		std::vector<int> edges;
+		std::vector<EdgeLinkInfo> links;
+		std::vector<float> shapes;
+		std::vector<int> order;
+		std::vector<BeamChild> kept;
+	};
+	void BeamSearch();
+	void ExpandBeamState(const BeamState & state, int parent, BeamScratch & scratch, std::vector<BeamChild> & children);
+	float PairColorShared(std::vector<EdgeLinkInfo> & links);
+	int m_AssemblyMode;
+	int m_BeamWidth;
+	std::vector<BeamMove> m_BeamPlan;
+	std::vector<BeamScratch> m_BeamScratch;	// by worker thread
+	int m_BeamNext;
+	bool m_BeamDone;
+
+	/* Relaxation labeling over edge matches. Every non-border edge holds a belief
+	   over its best partners, which is sharpened by how much the partner believes
+	   in it back and by the corner loops the match would close with the edges
+	   next to it. */
+	static const int m_RelaxCandidates=8;
+	struct MatchBeliefs {
+		int n;
+		int edge[m_RelaxCandidates];
+		float p[m_RelaxCandidates];
+	};
+	std::vector<MatchBeliefs> m_MatchBeliefs;	// by edge id
+	int m_RelaxIterations;	// at most, stops earlier once the beliefs settle
+	void RelaxMatchBeliefs();
+	float MatchBelief(const std::vector<MatchBeliefs> & beliefs, int e, int f);
+	float BeliefCost(std::vector<EdgeLinkInfo> & links);
 
 	/* Puzzle graphics */
 	ID3D10Effect*                       m_pEffect;
@@ -193,17 +372,64 @@ private:
 	Matrix4f							m_World;
 
 	HRESULT CreateGraphics(ID3D10Device * pDevice);
+	HRESULT CreatePieceTexture(PuzzlePiece & piece, ID3D10Device * pDevice);
 	HRESULT ExtractPuzzlePieces(char * file, ID3D10Device * pDevice);
-	bool ExtractPiece(Texture & tex, Texture & tmpTex, std::vector<Vector2f> & piecePixels, int i, int j, ID3D10Device * pDevice, char * fileName);
-	void ProcessPuzzlePiece(Texture & tex, int edgeInsetLevel, ID3D10Device * pDevice);
-	bool OnOutsideBoundary(int i, int j, Texture & tex);
-	bool OnBoundary(int i, int j, Texture & tex);
+	struct PieceComponent {
+		int root;
+		int nPixels;
+		int xMin, xMax, yMin, yMax;
+	};
+	void LabelComponents(Texture & tex, std::vector<int> & labels, std::vector<PieceComponent> & components);
+	bool ExtractPiece(Texture & tex, std::vector<int> & labels, PieceComponent & component, ID3D10Device * pDevice, char * fileName);
+	void SavePiece(Texture & piece, ID3D10Device * pDevice, char * fileName);
+
+	/* Streaming extraction, the sheet is labeled tileRows rows at a time and
+	   pieces are written out as soon as no later row can touch them */
+	struct PixelRun {
+		int y, x, n;
+		int offset;
+	};
+	struct OpenPiece {
+		int nPixels;
+		int xMin, xMax, yMin, yMax;
+		std::vector<PixelRun> runs;
+		std::vector<Vector4uc> texels;
+	};
+	HRESULT ExtractPuzzlePiecesTiled(char * file, int tileRows, ID3D10Device * pDevice);
+	bool EmitOpenPiece(OpenPiece & piece, ID3D10Device * pDevice, char * fileName);
+	int m_ExtractTileRows;
+	void ProcessPuzzlePiece(PuzzlePiece & piece, Texture & tex, int edgeInsetLevel);
+	void BuildEdgeProfiles();
+	float ProfileDistance(PuzzlePiece & a, int k, PuzzlePiece & b, int l, float profileSum);
+	int m_ProfileSize;	// slots of every profile, set once all pieces are loaded
+	void ComputeCurvatures(const std::vector<Vector2f> & pts, std::vector<float> & curvatures, std::vector<float> & angles);
+
+	/* Feature cache, <dir>/features.cache keyed by a hash of each piece file */
+	static unsigned long long HashBytes(const unsigned char * data, size_t size);
+	void WritePieceFeatures(PuzzlePiece & piece, std::vector<unsigned char> & out);
+	bool ReadPieceFeatures(PuzzlePiece & piece, const unsigned char * data, size_t size);
+	void ReadFeatureCache(const unsigned char * data, size_t size, std::map<unsigned long long, std::pair<const unsigned char *, size_t> > & entries);
+	void WriteFeatureCache(const char * fileName, std::vector<unsigned long long> & hashes);
+	/* Options that change the extracted features, a cache written with others is rebuilt */
+	unsigned int FeatureCacheSettings() { return m_SubPixelContour ? 1 : 0; }
+	bool m_SubPixelContour;
 	void AddPiece();
 	//float CompareEdgesByShape(PuzzlePiece & a, PuzzlePiece & b, int k, int l);
 	//float CompareEdgesByColor(PuzzlePiece & a, PuzzlePiece & b, int k, int l);
 	float CompareEdgesByShape(std::vector<EdgeLinkInfo> & links);
 	float CompareEdgesByColor(std::vector<EdgeLinkInfo> & links);
+	float EdgeColorDistance(PuzzlePiece & a, int k, PuzzlePiece & b, int l);
+	void ComputeGradientSums(PuzzlePiece & piece);
 	float MGC(Color ** left, Color ** right, int leftSize, int rightSize);
+	void BuildEdgeIndex();
+	bool EdgesCompatible(PuzzlePiece & a, int k, PuzzlePiece & b, int l);
+	void CompatibleEdges(PuzzlePiece & a, int k, std::vector<int> & edges);
+	void BuildFrontier();
+	void ScoreSlot(int cell);
+	void BuildPairScores();
+	PairScore & GetPairScore(PuzzlePiece & a, int k, PuzzlePiece & b, int l);
+	float PairShape(std::vector<EdgeLinkInfo> & links);
+	float PairColor(std::vector<EdgeLinkInfo> & links);
 	
 	struct Pocket{
 		PuzzlePiece* a;
@@ -224,17 +450,82 @@ private:
 		bool isAdded;
 		BorderStrip(PuzzlePiece* p):isAdded(false){pieces.push_back(p);}
 		void addToRight(PuzzlePiece* p) {pieces.push_front(p);}
-		void addToLeft(BorderStrip& bs) {pieces.insert(pieces.end(), bs.pieces.begin(), bs.pieces.end());}
+		void addToLeft(BorderStrip& bs) {pieces.splice(pieces.end(), bs.pieces);}
+	};
+	struct BorderMerge {
+		float confidence;
+		int strip;
+		int stamp;	// stale once the strip has been rescored or merged away
+		bool operator<(const BorderMerge & m) const { return confidence < m.confidence || (confidence == m.confidence && strip > m.strip); }
+	};
+	/* Orders the strips into a ring by branch and bound. A partial ring is cut
+	   once its joints plus the cheapest joint into each strip still out cannot
+	   beat the worst of the best m_BorderRings rings found so far, or once its
+	   corners can no longer make a rectangle. */
+	struct BorderRing {
+		float cost;
+		std::vector<int> strips;
+		bool operator<(const BorderRing & r) const { return cost < r.cost; }
+	};
+	struct BorderStripSearch {
+		std::vector<std::vector<float> > joint;	// row i col j: strip j lies to the left of strip i
+		std::vector<float> cheapestJoint;	// into each strip
+		std::vector<std::vector<int> > corners;	// positions of the corner pieces in each strip
+		std::vector<int> nPieces;
+		int total;
+		std::vector<int> ring;
+		std::vector<int> ringCorners;
+		int ringPieces;
+		std::vector<BorderRing> best;	// max-heap on cost
+		int nodes;
 	};
+	int m_MaxBorderStrips;	// strips are merged until at most this many are left, or fewer for the search to finish
+	int m_BorderRings;
+	int m_BorderSearchNodes;
+	int m_BorderAssembly;
 	void AssemblyBorderMST();
+	void LayOutBorderStrips(std::vector<BorderStrip>& strips);
+	bool SearchBorderRing(std::vector<BorderStrip>& strips, BorderStripSearch& search);
 	void AssemblyBorderWithDimension(int w, int h);
-	void borderSearch(float& globalMin, float recursiveMin, std::vector<PuzzlePiece*>& pool, std::list<int>& border, std::list<int>& optBorder, const std::vector<std::vector<float> >& assignMatrix, int length);
-	void borderStripSearch(float& globalMin, float recursiveMin, std::vector<BorderStrip>& pool, std::list<int>& recursiveBorder, std::vector<std::list<int>>& optBorder, int length);
+	void AssemblyBorderFindDimension();
+	void BuildBorderMatrix(std::vector<PuzzlePiece*>& borderPieces, std::vector<std::vector<float> >& assignMatrix);
+	float SolveBorderWithDimension(int w, int h, const std::vector<PuzzlePiece*>& borderPieces, const std::vector<std::vector<float> >& assignMatrix, std::list<int>& borders);
+	bool BorderRingFits(int w, int h, const std::vector<PuzzlePiece*>& borderPieces, const std::list<int>& borders);
+	void PlaceBorderRing(std::vector<PuzzlePiece*>& borderPieces, std::list<int>& borders);
+	void borderSearch(float& globalMin, float recursiveMin, const std::vector<PuzzlePiece*>& pool, std::vector<char>& used, std::list<int>& border, std::list<int>& optBorder, const std::vector<std::vector<float> >& assignMatrix, int length);
+	void borderStripSearch(BorderStripSearch& search, std::vector<BorderStrip>& pool, float cost, float bound, int length);
 public:
 	JPuzzle();
 	~JPuzzle() {}
 
 	HRESULT Init(char * dir, int nToLoad, ID3D10Device * pDevice);
+	/* 0 extracts from the whole decoded sheet, otherwise rows per streamed tile */
+	void SetExtractTileRows(int rows) { m_ExtractTileRows = rows; }
+	/* Place contour points on the alpha edge instead of at pixel centers */
+	void SetSubPixelContour(bool enable) { m_SubPixelContour = enable; }
+	/* Interior assembly keeps the k best candidates of each open slot */
+	void SetSlotCandidates(int k) { m_SlotCandidates = max(k, 1); }
+	/* Candidates with a mean shape distance under the gate are ranked by color */
+	void SetSlotShapeGate(float gate) { m_SlotShapeGate = gate; }
+	/* Interior pieces are placed greedily, along the best of width partial
+	   assemblies found by a beam search run on the first interior step, or
+	   greedily by the edge match beliefs of a relaxation labeling */
+	enum AssemblyMode { AssemblyGreedy, AssemblyBeam, AssemblyRelaxation };
+	void SetAssemblyMode(AssemblyMode mode) { m_AssemblyMode = mode; }
+	void SetBeamWidth(int width) { m_BeamWidth = max(width, 1); }
+	void SetRelaxIterations(int iterations) { m_RelaxIterations = iterations; }
+	/* The border ring search starts once at most n strips are left, keeps the k
+	   best rings and gives up extending them after the given number of nodes */
+	void SetMaxBorderStrips(int n) { m_MaxBorderStrips = max(n, 1); }
+	void SetBorderRings(int k) { m_BorderRings = max(k, 1); }
+	void SetBorderSearchNodes(int nodes) { m_BorderSearchNodes = nodes; }
+	/* The border is chained from strips, solved side by side for every puzzle
+	   size its border and corner pieces allow, or grown piece by piece from
+	   both ends of a single chain, kept only when it closes into a frame */
+	enum BorderAssembly { BorderFromStrips, BorderFromDimension, BorderFromChain };
+	void SetBorderAssembly(BorderAssembly assembly) { m_BorderAssembly = assembly; }
+	/* Heap allocations made so far, only counted when built with JPUZZLE_TRACK_ALLOCATIONS */
+	static unsigned long long AllocationCount();
 	void ComparePieces();
 	void Render(ID3D10Device * pDevice);
 	void MovePiece(EdgeLinkInfo & measure);
@@ -0,0 +1,90 @@
+
+#include "MappedFile.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile():m_Data(0), m_Size(0), m_File(INVALID_HANDLE_VALUE), m_Mapping(0)
+{
+}
+
+bool MappedFile::Open(const char * fileName)
+{
+	Close();
+	m_File = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_File == INVALID_HANDLE_VALUE) return 0;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(m_File, &size) || size.QuadPart == 0) {
+		Close();
+		return 0;
+	}
+	m_Mapping = CreateFileMappingA(m_File, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!m_Mapping) {
+		Close();
+		return 0;
+	}
+	m_Data = (const unsigned char*)MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!m_Data) {
+		Close();
+		return 0;
+	}
+	m_Size = (size_t)size.QuadPart;
+	return 1;
+}
+
+void MappedFile::Close()
+{
+	if (m_Data) UnmapViewOfFile(m_Data);
+	if (m_Mapping) CloseHandle(m_Mapping);
+	if (m_File != INVALID_HANDLE_VALUE) CloseHandle(m_File);
+	m_Data = 0;
+	m_Size = 0;
+	m_Mapping = 0;
+	m_File = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+MappedFile::MappedFile():m_Data(0), m_Size(0), m_File(-1)
+{
+}
+
+bool MappedFile::Open(const char * fileName)
+{
+	Close();
+	m_File = open(fileName, O_RDONLY);
+	if (m_File < 0) return 0;
+
+	struct stat st;
+	if (fstat(m_File, &st) != 0 || st.st_size == 0) {
+		Close();
+		return 0;
+	}
+	void * data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, m_File, 0);
+	if (data == MAP_FAILED) {
+		Close();
+		return 0;
+	}
+	m_Data = (const unsigned char*)data;
+	m_Size = (size_t)st.st_size;
+	return 1;
+}
+
+void MappedFile::Close()
+{
+	if (m_Data) munmap((void*)m_Data, m_Size);
+	if (m_File >= 0) close(m_File);
+	m_Data = 0;
+	m_Size = 0;
+	m_File = -1;
+}
+
+#endif
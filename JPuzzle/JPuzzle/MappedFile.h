@@ -0,0 +1,34 @@
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+
+/* Read-only memory mapping of a whole file. Pages are brought in by the OS on
+   demand, so streaming over a mapping keeps the resident set small. */
+class MappedFile {
+public:
+	MappedFile();
+	~MappedFile() { Close(); }
+
+	bool Open(const char * fileName);
+	void Close();
+
+	const unsigned char * Data() const { return m_Data; }
+	size_t Size() const { return m_Size; }
+
+private:
+	MappedFile(const MappedFile &);
+	void operator=(const MappedFile &);
+
+	const unsigned char * m_Data;
+	size_t m_Size;
+#ifdef _WIN32
+	void * m_File;
+	void * m_Mapping;
+#else
+	int m_File;
+#endif
+};
+
+#endif
@@ -0,0 +1,613 @@
+
+#include "Png.h"
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+static const int kFastBits = 9;
+static const int kWindowSize = 1<<15;
+
+struct PngDecoder::Huffman {
+	unsigned short fast[1<<kFastBits];	// (symbol << 4) | length, 0 if the code is longer than kFastBits
+	unsigned short count[16];
+	unsigned short symbol[288];
+
+	bool Build(const unsigned char * lengths, int n) {
+		memset(fast, 0, sizeof(fast));
+		memset(count, 0, sizeof(count));
+		for (int i=0; i<n; i++) count[lengths[i]]++;
+		count[0] = 0;
+
+		int left = 1;
+		for (int len=1; len<16; len++) {
+			left <<= 1;
+			left -= count[len];
+			if (left < 0) return 0; // over-subscribed
+		}
+
+		unsigned short offsets[16];
+		offsets[1] = 0;
+		for (int len=1; len<15; len++) offsets[len+1] = offsets[len] + count[len];
+		for (int i=0; i<n; i++)
+			if (lengths[i]) symbol[offsets[lengths[i]]++] = i;
+
+		/* Canonical codes, bit-reversed for the LSB-first lookup table */
+		int code = 0;
+		int next[16];
+		for (int len=1; len<16; len++) {
+			next[len] = code;
+			code = (code + count[len]) << 1;
+		}
+		for (int i=0; i<n; i++) {
+			int len = lengths[i];
+			if (len == 0 || len > kFastBits) continue;
+			int c = next[len]++;
+			int rev = 0;
+			for (int b=0; b<len; b++) rev |= ((c >> b) & 1) << (len-b-1);
+			for (int fill=rev; fill<(1<<kFastBits); fill+=(1<<len))
+				fast[fill] = (unsigned short)((i << 4) | len);
+		}
+		return 1;
+	}
+};
+
+static const unsigned short kLengthBase[29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const unsigned char kLengthExtra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+static const unsigned short kDistBase[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+static const unsigned char kDistExtra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+static unsigned int ReadBE32(const unsigned char * p)
+{
+	return ((unsigned int)p[0]<<24) | ((unsigned int)p[1]<<16) | ((unsigned int)p[2]<<8) | p[3];
+}
+
+PngDecoder::PngDecoder():m_Data(0), m_Size(0), m_Width(0), m_Height(0), m_BitDepth(0), m_ColorType(0), m_Channels(0), m_HasKey(0)
+{
+}
+
+bool PngDecoder::Open(const char * fileName)
+{
+	FILE * file = fopen(fileName, "rb");
+	if (!file) return 0;
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	if (size <= 0) { fclose(file); return 0; }
+	m_File.resize(size);
+	size_t nRead = fread(m_File.data(), 1, size, file);
+	fclose(file);
+	if (nRead != (size_t)size) return 0;
+	return Open(m_File.data(), m_File.size());
+}
+
+bool PngDecoder::Open(const unsigned char * data, size_t size)
+{
+	static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+	m_Data = data;
+	m_Size = size;
+	if (size < 8 || memcmp(data, signature, 8) != 0) return 0;
+	return ParseChunks();
+}
+
+bool PngDecoder::ParseChunks()
+{
+	m_Idat.clear();
+	m_HasKey = 0;
+	for (int i=0; i<256; i++) {
+		m_Palette[i][0] = m_Palette[i][1] = m_Palette[i][2] = 0;
+		m_Palette[i][3] = 255;
+	}
+
+	bool haveHeader = 0;
+	size_t pos = 8;
+	while (pos + 12 <= m_Size) {
+		unsigned int len = ReadBE32(m_Data + pos);
+		const unsigned char * type = m_Data + pos + 4;
+		const unsigned char * body = m_Data + pos + 8;
+		if (len > m_Size - pos - 12) return 0;
+
+		if (memcmp(type, "IHDR", 4) == 0) {
+			if (len < 13) return 0;
+			m_Width = ReadBE32(body);
+			m_Height = ReadBE32(body+4);
+			m_BitDepth = body[8];
+			m_ColorType = body[9];
+			if (body[10] != 0 || body[11] != 0) return 0;
+			if (body[12] != 0) return 0; // Adam7 interlacing is not supported
+			switch (m_ColorType) {
+			case 0: m_Channels = 1; break;
+			case 2: m_Channels = 3; if (m_BitDepth < 8) return 0; break;
+			case 3: m_Channels = 1; if (m_BitDepth > 8) return 0; break;
+			case 4: m_Channels = 2; if (m_BitDepth < 8) return 0; break;
+			case 6: m_Channels = 4; if (m_BitDepth < 8) return 0; break;
+			default: return 0;
+			}
+			if (m_BitDepth != 1 && m_BitDepth != 2 && m_BitDepth != 4 && m_BitDepth != 8 && m_BitDepth != 16) return 0;
+			if (m_Width <= 0 || m_Height <= 0) return 0;
+			haveHeader = 1;
+		} else if (memcmp(type, "PLTE", 4) == 0) {
+			for (unsigned int i=0; i<len/3 && i<256; i++) {
+				m_Palette[i][0] = body[3*i+0];
+				m_Palette[i][1] = body[3*i+1];
+				m_Palette[i][2] = body[3*i+2];
+			}
+		} else if (memcmp(type, "tRNS", 4) == 0) {
+			if (m_ColorType == 3) {
+				for (unsigned int i=0; i<len && i<256; i++) m_Palette[i][3] = body[i];
+			} else if (m_ColorType == 0 && len >= 2) {
+				m_HasKey = 1;
+				m_Key[0] = (body[0]<<8) | body[1];
+			} else if (m_ColorType == 2 && len >= 6) {
+				m_HasKey = 1;
+				for (int c=0; c<3; c++) m_Key[c] = (body[2*c]<<8) | body[2*c+1];
+			}
+		} else if (memcmp(type, "IDAT", 4) == 0) {
+			m_Idat.push_back(std::make_pair(body, (size_t)len));
+		} else if (memcmp(type, "IEND", 4) == 0) {
+			break;
+		}
+		pos += 12 + len;
+	}
+	return haveHeader && !m_Idat.empty();
+}
+
+void PngDecoder::Refill()
+{
+	while (m_BitCount <= 56) {
+		while (m_IdatChunk < m_Idat.size() && m_IdatPos >= m_Idat[m_IdatChunk].second) {
+			m_IdatChunk++;
+			m_IdatPos = 0;
+		}
+		unsigned long long byte = 0;
+		if (m_IdatChunk < m_Idat.size()) byte = m_Idat[m_IdatChunk].first[m_IdatPos++];
+		else m_Overrun++;
+		m_BitBuf |= byte << m_BitCount;
+		m_BitCount += 8;
+	}
+}
+
+int PngDecoder::DecodeSymbol(const Huffman & h)
+{
+	unsigned int entry = h.fast[PeekBits(16) & ((1<<kFastBits)-1)];
+	if (entry) {
+		DropBits(entry & 15);
+		return entry >> 4;
+	}
+
+	/* Slow path for long codes, one bit at a time */
+	int code = 0, first = 0, index = 0;
+	for (int len=1; len<16; len++) {
+		code |= GetBits(1);
+		int count = h.count[len];
+		if (code - count < first)
+			return h.symbol[index + (code - first)];
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+	return -1;
+}
+
+void PngDecoder::Put(unsigned char b)
+{
+	m_Window[m_OutPos & (kWindowSize-1)] = b;
+	m_OutPos++;
+}
+
+bool PngDecoder::Copy(int dist, int len)
+{
+	if ((unsigned long long)dist > m_OutPos) return 0;
+	for (int i=0; i<len; i++) {
+		m_Window[m_OutPos & (kWindowSize-1)] = m_Window[(m_OutPos-dist) & (kWindowSize-1)];
+		m_OutPos++;
+	}
+	return 1;
+}
+
+void PngDecoder::Flush()
+{
+	while (m_Flushed < m_OutPos) {
+		int start = (int)(m_Flushed & (kWindowSize-1));
+		int n = (int)(m_OutPos - m_Flushed);
+		if (start + n > kWindowSize) n = kWindowSize - start;
+		ConsumeScanlineBytes(&m_Window[start], n);
+		m_Flushed += n;
+	}
+}
+
+bool PngDecoder::InflateBlock(const Huffman & lit, const Huffman & dist)
+{
+	for (;;) {
+		int sym = DecodeSymbol(lit);
+		if (sym < 0) return 0;
+		if (sym < 256) {
+			Put((unsigned char)sym);
+		} else if (sym == 256) {
+			return 1;
+		} else {
+			sym -= 257;
+			if (sym >= 29) return 0;
+			int len = kLengthBase[sym] + GetBits(kLengthExtra[sym]);
+			int dsym = DecodeSymbol(dist);
+			if (dsym < 0 || dsym >= 30) return 0;
+			int d = kDistBase[dsym] + GetBits(kDistExtra[dsym]);
+			if (!Copy(d, len)) return 0;
+		}
+		if (m_OutPos - m_Flushed >= kWindowSize/2) Flush();
+		if (m_Overrun > 8) return 0;
+	}
+}
+
+bool PngDecoder::InflateStored()
+{
+	DropBits(m_BitCount & 7);
+	unsigned int len = GetBits(16);
+	unsigned int nlen = GetBits(16);
+	if ((len ^ 0xffff) != nlen) return 0;
+	for (unsigned int i=0; i<len; i++) {
+		Put((unsigned char)GetBits(8));
+		if (m_OutPos - m_Flushed >= kWindowSize/2) Flush();
+	}
+	return m_Overrun <= 8;
+}
+
+bool PngDecoder::InflateDynamic(Huffman & lit, Huffman & dist)
+{
+	static const unsigned char order[19] = {16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15};
+	int nLit = GetBits(5) + 257;
+	int nDist = GetBits(5) + 1;
+	int nCode = GetBits(4) + 4;
+	if (nLit > 286 || nDist > 30) return 0;
+
+	unsigned char lengths[288+32];
+	memset(lengths, 0, 19);
+	for (int i=0; i<nCode; i++) lengths[order[i]] = (unsigned char)GetBits(3);
+	Huffman codeLengths;
+	if (!codeLengths.Build(lengths, 19)) return 0;
+
+	int n = 0;
+	while (n < nLit + nDist) {
+		int sym = DecodeSymbol(codeLengths);
+		if (sym < 0) return 0;
+		if (sym < 16) {
+			lengths[n++] = (unsigned char)sym;
+			continue;
+		}
+		int rep = 0;
+		unsigned char value = 0;
+		if (sym == 16) {
+			if (n == 0) return 0;
+			value = lengths[n-1];
+			rep = 3 + GetBits(2);
+		} else if (sym == 17) {
+			rep = 3 + GetBits(3);
+		} else {
+			rep = 11 + GetBits(7);
+		}
+		if (n + rep > nLit + nDist) return 0;
+		while (rep--) lengths[n++] = value;
+	}
+	if (lengths[256] == 0) return 0;
+	return lit.Build(lengths, nLit) && dist.Build(lengths+nLit, nDist);
+}
+
+bool PngDecoder::Inflate()
+{
+	unsigned int cmf = GetBits(8);
+	unsigned int flg = GetBits(8);
+	if ((cmf & 15) != 8 || ((cmf<<8) | flg) % 31 != 0 || (flg & 32)) return 0;
+
+	Huffman * lit = new Huffman;
+	Huffman * dist = new Huffman;
+	bool ok = 1;
+	bool last = 0;
+	while (ok && !last) {
+		last = GetBits(1) != 0;
+		int type = GetBits(2);
+		if (type == 0) {
+			ok = InflateStored();
+		} else if (type == 1) {
+			unsigned char lengths[288+32];
+			memset(lengths, 8, 144);
+			memset(lengths+144, 9, 112);
+			memset(lengths+256, 7, 24);
+			memset(lengths+280, 8, 8);
+			memset(lengths+288, 5, 32);
+			ok = lit->Build(lengths, 288) && dist->Build(lengths+288, 30) && InflateBlock(*lit, *dist);
+		} else if (type == 2) {
+			ok = InflateDynamic(*lit, *dist) && InflateBlock(*lit, *dist);
+		} else {
+			ok = 0;
+		}
+		if (m_Row >= m_Height) break;
+	}
+	Flush();
+	delete lit;
+	delete dist;
+	return ok && m_Row >= m_Height;
+}
+
+void PngDecoder::ConsumeScanlineBytes(const unsigned char * data, int n)
+{
+	while (n > 0 && m_Row < m_Height) {
+		int take = (int)m_Scanline.size() - m_ScanlineFill;
+		if (take > n) take = n;
+		memcpy(&m_Scanline[m_ScanlineFill], data, take);
+		m_ScanlineFill += take;
+		data += take;
+		n -= take;
+		if (m_ScanlineFill == (int)m_Scanline.size()) {
+			FinishScanline();
+			m_ScanlineFill = 0;
+		}
+	}
+}
+
+void PngDecoder::FinishScanline()
+{
+	/* Undo the scanline filter in place, m_Scanline[0] is the filter type */
+	int bpp = (m_Channels*m_BitDepth + 7)/8;
+	unsigned char * cur = &m_Scanline[1];
+	const unsigned char * prev = &m_PrevScanline[1];
+	int filter = m_Scanline[0];
+	for (int i=0; i<m_Stride; i++) {
+		int a = i >= bpp ? cur[i-bpp] : 0;
+		int b = prev[i];
+		int c = i >= bpp ? prev[i-bpp] : 0;
+		switch (filter) {
+		case 1: cur[i] = (unsigned char)(cur[i] + a); break;
+		case 2: cur[i] = (unsigned char)(cur[i] + b); break;
+		case 3: cur[i] = (unsigned char)(cur[i] + ((a + b) >> 1)); break;
+		case 4: {
+			int p = a + b - c;
+			int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+			int pred = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+			cur[i] = (unsigned char)(cur[i] + pred);
+			break;
+		}
+		default: break;
+		}
+	}
+
+	/* Expand to RGBA8 */
+	unsigned char * out = m_RowRGBA.data();
+	if (m_BitDepth == 8 && m_ColorType == 6) {
+		memcpy(out, cur, 4*m_Width);
+	} else {
+		for (int x=0; x<m_Width; x++) {
+			unsigned short v[4];
+			if (m_BitDepth == 16) {
+				for (int c=0; c<m_Channels; c++) v[c] = (cur[2*(x*m_Channels+c)]<<8) | cur[2*(x*m_Channels+c)+1];
+			} else if (m_BitDepth == 8) {
+				for (int c=0; c<m_Channels; c++) v[c] = cur[x*m_Channels+c];
+			} else {
+				int bit = x*m_BitDepth;
+				v[0] = (cur[bit>>3] >> (8 - m_BitDepth - (bit&7))) & ((1<<m_BitDepth)-1);
+			}
+			int shift = m_BitDepth == 16 ? 8 : 0;
+			unsigned char * px = out + 4*x;
+			switch (m_ColorType) {
+			case 0: {
+				unsigned char g = m_BitDepth < 8 ? (unsigned char)(v[0]*255/((1<<m_BitDepth)-1)) : (unsigned char)(v[0] >> shift);
+				px[0] = px[1] = px[2] = g;
+				px[3] = (m_HasKey && v[0] == m_Key[0]) ? 0 : 255;
+				break;
+			}
+			case 2:
+				px[0] = (unsigned char)(v[0] >> shift);
+				px[1] = (unsigned char)(v[1] >> shift);
+				px[2] = (unsigned char)(v[2] >> shift);
+				px[3] = (m_HasKey && v[0] == m_Key[0] && v[1] == m_Key[1] && v[2] == m_Key[2]) ? 0 : 255;
+				break;
+			case 3:
+				memcpy(px, m_Palette[v[0] & 255], 4);
+				break;
+			case 4:
+				px[0] = px[1] = px[2] = (unsigned char)(v[0] >> shift);
+				px[3] = (unsigned char)(v[1] >> shift);
+				break;
+			default:
+				for (int c=0; c<4; c++) px[c] = (unsigned char)(v[c] >> shift);
+				break;
+			}
+		}
+	}
+	(*m_OnRow)(m_Row++, out);
+
+	m_Scanline.swap(m_PrevScanline);
+}
+
+bool PngDecoder::DecodeRows(const RowCallback & onRow)
+{
+	if (m_Idat.empty()) return 0;
+
+	m_IdatChunk = 0;
+	m_IdatPos = 0;
+	m_BitBuf = 0;
+	m_BitCount = 0;
+	m_Overrun = 0;
+	m_Window.resize(kWindowSize);
+	m_OutPos = 0;
+	m_Flushed = 0;
+	m_Stride = (m_Width*m_Channels*m_BitDepth + 7)/8;
+	m_Scanline.assign(m_Stride+1, 0);
+	m_PrevScanline.assign(m_Stride+1, 0);
+	m_RowRGBA.resize(4*m_Width);
+	m_ScanlineFill = 0;
+	m_Row = 0;
+	m_OnRow = &onRow;
+
+	bool ok = Inflate();
+	m_OnRow = 0;
+	return ok;
+}
+
+bool PngDecoder::Decode(unsigned char * rgba, int pitch)
+{
+	int width = m_Width;
+	return DecodeRows([rgba, pitch, width] (int row, const unsigned char * src) {
+		memcpy(rgba + (size_t)row*pitch, src, 4*width);
+	});
+}
+
+static unsigned int Crc32(unsigned int crc, const unsigned char * data, size_t n)
+{
+	static unsigned int table[256];
+	static bool init = 0;
+	if (!init) {
+		for (unsigned int i=0; i<256; i++) {
+			unsigned int c = i;
+			for (int k=0; k<8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+		init = 1;
+	}
+	crc = ~crc;
+	for (size_t i=0; i<n; i++) crc = table[(crc ^ data[i]) & 255] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void WriteBE32(std::vector<unsigned char> & out, unsigned int v)
+{
+	out.push_back((unsigned char)(v >> 24));
+	out.push_back((unsigned char)(v >> 16));
+	out.push_back((unsigned char)(v >> 8));
+	out.push_back((unsigned char)v);
+}
+
+static void WriteChunk(std::vector<unsigned char> & out, const char * type, const unsigned char * data, size_t n)
+{
+	WriteBE32(out, (unsigned int)n);
+	size_t start = out.size();
+	out.insert(out.end(), type, type+4);
+	out.insert(out.end(), data, data+n);
+	WriteBE32(out, Crc32(0, &out[start], n+4));
+}
+
+struct BitWriter {
+	std::vector<unsigned char> & out;
+	unsigned int buf;
+	int count;
+	BitWriter(std::vector<unsigned char> & _out):out(_out), buf(0), count(0) {}
+	void Put(unsigned int bits, int n) {
+		buf |= bits << count;
+		count += n;
+		while (count >= 8) {
+			out.push_back((unsigned char)buf);
+			buf >>= 8;
+			count -= 8;
+		}
+	}
+	void PutReversed(unsigned int code, int n) {
+		unsigned int rev = 0;
+		for (int i=0; i<n; i++) rev |= ((code >> i) & 1) << (n-i-1);
+		Put(rev, n);
+	}
+	void Finish() {
+		if (count > 0) out.push_back((unsigned char)buf);
+		buf = 0;
+		count = 0;
+	}
+};
+
+static void PutFixedLiteral(BitWriter & bw, int v)
+{
+	if (v < 144) bw.PutReversed(0x30 + v, 8);
+	else if (v < 256) bw.PutReversed(0x190 + v - 144, 9);
+	else if (v < 280) bw.PutReversed(v - 256, 7);
+	else bw.PutReversed(0xc0 + v - 280, 8);
+}
+
+/* Greedy LZ77 with a single-entry hash table, emitted as one fixed-code block */
+static void Deflate(const std::vector<unsigned char> & in, std::vector<unsigned char> & out)
+{
+	static const int kHashBits = 15;
+	out.push_back(0x78);
+	out.push_back(0x01);
+
+	BitWriter bw(out);
+	bw.Put(1, 1);	// final block
+	bw.Put(1, 2);	// fixed codes
+
+	std::vector<int> head(1<<kHashBits, -1);
+	int n = (int)in.size();
+	auto Hash = [&in] (int i) {
+		return ((in[i] << 10) ^ (in[i+1] << 5) ^ in[i+2]) & ((1<<kHashBits)-1);
+	};
+	int i = 0;
+	while (i < n) {
+		int bestLen = 0, bestDist = 0;
+		if (i + 2 < n) {
+			int h = Hash(i);
+			int cand = head[h];
+			head[h] = i;
+			if (cand >= 0 && i - cand <= kWindowSize) {
+				int maxLen = std::min(258, n - i);
+				int len = 0;
+				while (len < maxLen && in[cand+len] == in[i+len]) len++;
+				if (len >= 3) bestLen = len, bestDist = i - cand;
+			}
+		}
+		if (bestLen == 0) {
+			PutFixedLiteral(bw, in[i++]);
+			continue;
+		}
+
+		int lsym = 0;
+		while (lsym < 28 && kLengthBase[lsym+1] <= bestLen) lsym++;
+		PutFixedLiteral(bw, 257 + lsym);
+		bw.Put(bestLen - kLengthBase[lsym], kLengthExtra[lsym]);
+		int dsym = 0;
+		while (dsym < 29 && kDistBase[dsym+1] <= bestDist) dsym++;
+		bw.PutReversed(dsym, 5);
+		bw.Put(bestDist - kDistBase[dsym], kDistExtra[dsym]);
+
+		for (int k=1; k<bestLen; k++) {
+			if (i + k + 2 < n) head[Hash(i+k)] = i + k;
+		}
+		i += bestLen;
+	}
+	PutFixedLiteral(bw, 256);
+	bw.Finish();
+
+	unsigned int s1 = 1, s2 = 0;
+	for (int k=0; k<n; k++) {
+		s1 = (s1 + in[k]) % 65521;
+		s2 = (s2 + s1) % 65521;
+	}
+	WriteBE32(out, (s2 << 16) | s1);
+}
+
+bool WritePng(const char * fileName, const unsigned char * rgba, int width, int height, int pitch)
+{
+	std::vector<unsigned char> raw((size_t)height*(4*width+1));
+	for (int row=0; row<height; row++) {
+		unsigned char * dst = &raw[(size_t)row*(4*width+1)];
+		dst[0] = 0;
+		memcpy(dst+1, rgba + (size_t)row*pitch, 4*width);
+	}
+	std::vector<unsigned char> idat;
+	Deflate(raw, idat);
+
+	static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+	std::vector<unsigned char> out(signature, signature+8);
+	unsigned char header[13];
+	header[0] = (unsigned char)(width >> 24); header[1] = (unsigned char)(width >> 16);
+	header[2] = (unsigned char)(width >> 8); header[3] = (unsigned char)width;
+	header[4] = (unsigned char)(height >> 24); header[5] = (unsigned char)(height >> 16);
+	header[6] = (unsigned char)(height >> 8); header[7] = (unsigned char)height;
+	header[8] = 8;		// bit depth
+	header[9] = 6;		// RGBA
+	header[10] = header[11] = header[12] = 0;
+	WriteChunk(out, "IHDR", header, 13);
+	WriteChunk(out, "IDAT", idat.data(), idat.size());
+	WriteChunk(out, "IEND", 0, 0);
+
+	FILE * file = fopen(fileName, "wb");
+	if (!file) return 0;
+	bool ok = fwrite(out.data(), 1, out.size(), file) == out.size();
+	fclose(file);
+	return ok;
+}
@@ -0,0 +1,87 @@
+
+#ifndef PNG_H
+#define PNG_H
+
+#include <vector>
+#include <functional>
+#include <cstddef>
+
+/* Portable PNG reader with no Windows or Direct3D dependency. Every supported
+   format (gray, gray+alpha, RGB, RGBA and palette at any legal bit depth,
+   non-interlaced) is expanded to 8-bit RGBA and handed out one row at a time,
+   so callers can decode straight into their own texel storage. */
+class PngDecoder {
+public:
+	typedef std::function<void(int row, const unsigned char * rgba)> RowCallback;
+
+	PngDecoder();
+	~PngDecoder() {}
+
+	bool Open(const char * fileName);
+	bool Open(const unsigned char * data, size_t size);
+
+	int Width() const { return m_Width; }
+	int Height() const { return m_Height; }
+
+	bool DecodeRows(const RowCallback & onRow);
+	bool Decode(unsigned char * rgba, int pitch);
+
+private:
+	struct Huffman;
+
+	bool ParseChunks();
+	bool Inflate();
+	bool InflateBlock(const Huffman & lit, const Huffman & dist);
+	bool InflateStored();
+	bool InflateDynamic(Huffman & lit, Huffman & dist);
+	int DecodeSymbol(const Huffman & h);
+
+	void Refill();
+	unsigned int PeekBits(int n) { if (m_BitCount < n) Refill(); return (unsigned int)(m_BitBuf & ((1ull<<n)-1)); }
+	void DropBits(int n) { m_BitBuf >>= n; m_BitCount -= n; }
+	unsigned int GetBits(int n) { unsigned int v = PeekBits(n); DropBits(n); return v; }
+
+	void Put(unsigned char b);
+	bool Copy(int dist, int len);
+	void Flush();
+	void ConsumeScanlineBytes(const unsigned char * data, int n);
+	void FinishScanline();
+
+	std::vector<unsigned char> m_File;
+	const unsigned char * m_Data;
+	size_t m_Size;
+
+	int m_Width;
+	int m_Height;
+	int m_BitDepth;
+	int m_ColorType;
+	int m_Channels;
+	unsigned char m_Palette[256][4];
+	bool m_HasKey;
+	unsigned short m_Key[3];
+
+	/* Compressed stream, spread over the IDAT chunks */
+	std::vector<std::pair<const unsigned char *, size_t> > m_Idat;
+	size_t m_IdatChunk;
+	size_t m_IdatPos;
+	unsigned long long m_BitBuf;
+	int m_BitCount;
+	int m_Overrun;
+
+	/* Inflate window and scanline reconstruction */
+	std::vector<unsigned char> m_Window;
+	unsigned long long m_OutPos;
+	unsigned long long m_Flushed;
+	std::vector<unsigned char> m_Scanline;
+	std::vector<unsigned char> m_PrevScanline;
+	std::vector<unsigned char> m_RowRGBA;
+	int m_ScanlineFill;
+	int m_Stride;
+	int m_Row;
+	const RowCallback * m_OnRow;
+};
+
+/* Writes 8-bit RGBA rows, pitch bytes apart, as a PNG compressed with fixed-code deflate */
+bool WritePng(const char * fileName, const unsigned char * rgba, int width, int height, int pitch);
+
+#endif
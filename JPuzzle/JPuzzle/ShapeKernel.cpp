@@ -0,0 +1,148 @@
+
+#include "ShapeKernel.h"
+#include <cmath>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SHAPEKERNEL_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SHAPEKERNEL_AVX
+#else
+#include <cpuid.h>
+#define SHAPEKERNEL_AVX __attribute__((target("avx")))
+#endif
+#elif defined(__ARM_NEON) || defined(_M_ARM) || defined(_M_ARM64)
+#define SHAPEKERNEL_NEON
+#include <arm_neon.h>
+#endif
+
+typedef void (*ShapeBatchFn)(const float *, const float * const *, int, int, float *);
+
+static void ShapeDistanceScalar(const float * profile, const float * const * candidates, int nCandidates, int size, float * sums)
+{
+	for (int c=0; c<nCandidates; c++) {
+		const float * candidate = candidates[c];
+		float sum = 0;
+		for (int s=0; s<size; s++)
+			sum += std::abs(profile[s] + candidate[s]);
+		sums[c] = sum;
+	}
+}
+
+#ifdef SHAPEKERNEL_X86
+static bool CpuHasAvx()
+{
+	/* AVX needs both the CPU flag and the OS saving the ymm registers */
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1<<27)) != 0, avx = (info[2] & (1<<28)) != 0;
+	if (!osxsave || !avx) return 0;
+	return (_xgetbv(0) & 6) == 6;
+#else
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return 0;
+	if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) return 0;
+	unsigned int lo, hi;
+	__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return (lo & 6) == 6;
+#endif
+}
+
+static SHAPEKERNEL_AVX float HorizontalSum(__m256 v)
+{
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+
+static SHAPEKERNEL_AVX void ShapeDistanceAvx(const float * profile, const float * const * candidates, int nCandidates, int size, float * sums)
+{
+	/* Four candidates share every load of the profile */
+	const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	int body = size & ~7;
+	int c = 0;
+	for (; c+4 <= nCandidates; c+=4) {
+		const float * c0 = candidates[c], * c1 = candidates[c+1], * c2 = candidates[c+2], * c3 = candidates[c+3];
+		__m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps(), acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+		for (int s=0; s<body; s+=8) {
+			__m256 p = _mm256_loadu_ps(profile+s);
+			acc0 = _mm256_add_ps(acc0, _mm256_and_ps(absMask, _mm256_add_ps(p, _mm256_loadu_ps(c0+s))));
+			acc1 = _mm256_add_ps(acc1, _mm256_and_ps(absMask, _mm256_add_ps(p, _mm256_loadu_ps(c1+s))));
+			acc2 = _mm256_add_ps(acc2, _mm256_and_ps(absMask, _mm256_add_ps(p, _mm256_loadu_ps(c2+s))));
+			acc3 = _mm256_add_ps(acc3, _mm256_and_ps(absMask, _mm256_add_ps(p, _mm256_loadu_ps(c3+s))));
+		}
+		sums[c] = HorizontalSum(acc0);
+		sums[c+1] = HorizontalSum(acc1);
+		sums[c+2] = HorizontalSum(acc2);
+		sums[c+3] = HorizontalSum(acc3);
+		for (int s=body; s<size; s++) {
+			sums[c] += std::abs(profile[s] + c0[s]);
+			sums[c+1] += std::abs(profile[s] + c1[s]);
+			sums[c+2] += std::abs(profile[s] + c2[s]);
+			sums[c+3] += std::abs(profile[s] + c3[s]);
+		}
+	}
+	for (; c<nCandidates; c++) {
+		const float * candidate = candidates[c];
+		__m256 acc = _mm256_setzero_ps();
+		for (int s=0; s<body; s+=8)
+			acc = _mm256_add_ps(acc, _mm256_and_ps(absMask, _mm256_add_ps(_mm256_loadu_ps(profile+s), _mm256_loadu_ps(candidate+s))));
+		sums[c] = HorizontalSum(acc);
+		for (int s=body; s<size; s++)
+			sums[c] += std::abs(profile[s] + candidate[s]);
+	}
+	_mm256_zeroupper();
+}
+#endif
+
+#ifdef SHAPEKERNEL_NEON
+static void ShapeDistanceNeon(const float * profile, const float * const * candidates, int nCandidates, int size, float * sums)
+{
+	int body = size & ~3;
+	for (int c=0; c<nCandidates; c++) {
+		const float * candidate = candidates[c];
+		float32x4_t acc = vdupq_n_f32(0);
+		for (int s=0; s<body; s+=4)
+			acc = vaddq_f32(acc, vabsq_f32(vaddq_f32(vld1q_f32(profile+s), vld1q_f32(candidate+s))));
+		float32x2_t half = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+		float sum = vget_lane_f32(vpadd_f32(half, half), 0);
+		for (int s=body; s<size; s++)
+			sum += std::abs(profile[s] + candidate[s]);
+		sums[c] = sum;
+	}
+}
+#endif
+
+static ShapeBatchFn SelectShapeKernel(const char *& name)
+{
+#ifdef SHAPEKERNEL_X86
+	if (CpuHasAvx()) {
+		name = "avx";
+		return ShapeDistanceAvx;
+	}
+#endif
+#ifdef SHAPEKERNEL_NEON
+	name = "neon";
+	return ShapeDistanceNeon;
+#else
+	name = "scalar";
+	return ShapeDistanceScalar;
+#endif
+}
+
+/* Chosen during static initialization, before any worker thread can call in */
+static const char * g_ShapeKernelName = 0;
+static ShapeBatchFn g_ShapeKernel = SelectShapeKernel(g_ShapeKernelName);
+
+void ShapeDistanceBatch(const float * profile, const float * const * candidates, int nCandidates, int size, float * sums)
+{
+	g_ShapeKernel(profile, candidates, nCandidates, size, sums);
+}
+
+const char * ShapeKernelName()
+{
+	return g_ShapeKernelName;
+}
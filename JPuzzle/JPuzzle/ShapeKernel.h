@@ -0,0 +1,15 @@
+
+#ifndef SHAPEKERNEL_H
+#define SHAPEKERNEL_H
+
+/* Sum over s of |profile[s] + candidates[c][s]| for every candidate, written
+   to sums[c]. This is the inner loop of the edge shape distance, one edge
+   scored against a batch of reversed candidate profiles. The AVX or NEON
+   version is picked once at startup from what the CPU supports, with a
+   scalar fallback. */
+void ShapeDistanceBatch(const float * profile, const float * const * candidates, int nCandidates, int size, float * sums);
+
+/* Name of the kernel ShapeDistanceBatch dispatches to, for logging */
+const char * ShapeKernelName();
+
+#endif